@@ -0,0 +1,97 @@
+/**
+ * @file bench_c2c.c
+ * @brief False sharing benchmark for the tpool layout. Producer threads add empty jobs as fast as
+ *          they can while the workers run them, so the producer side and the consumer side of the
+ *          tpool are hammered at the same time. Meant to be run under perf c2c, once for each
+ *          layout (make bench_c2c builds both):
+ *
+ *              perf c2c record -- ./bench_c2c 4 4
+ *              perf c2c report --stats     (compare "Load HITM" / "Total HITM")
+ *              perf c2c record -- ./bench_c2c_packed 4 4
+ *              perf c2c report --stats
+ *
+ *          Usage: bench_c2c [producers] [workers] [jobs per producer]
+ *          Output: CSV, one line with the throughput
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "../tpool.h"
+
+#define DEFAULT_PRODUCERS   2
+#define DEFAULT_WORKERS     2
+#define DEFAULT_JOBS        200000
+
+static tpool_t *tpool;
+static int jobs_per_producer;
+
+/**
+ * @brief The job does nothing, so that only the tpool overhead is measured
+ *
+ * @param arg unused
+ */
+static void job_fn (void *arg)
+{
+    (void)arg;
+}
+/**
+ * @brief The producer thread, adds jobs_per_producer jobs
+ *
+ * @param arg unused
+ * @return void* always returns NULL
+ */
+static void *producer (void *arg)
+{
+    int i;
+    (void)arg;
+    for(i=0; i<jobs_per_producer; i++) {
+        tpool_add_job (tpool, job_fn, NULL, NULL, TPOOL_NO_OPT);
+    }
+    return NULL;
+}
+
+int main (int argc, char **argv)
+{
+    int producers = (argc > 1) ? atoi (argv[1]) : DEFAULT_PRODUCERS;
+    int workers = (argc > 2) ? atoi (argv[2]) : DEFAULT_WORKERS;
+    jobs_per_producer = (argc > 3) ? atoi (argv[3]) : DEFAULT_JOBS;
+    struct timespec start, end;
+    pthread_t *threads;
+    int i;
+
+    if(producers <= 0 || workers <= 0 || jobs_per_producer <= 0) {
+        fprintf(stderr, "usage: %s [producers] [workers] [jobs per producer]\n", argv[0]);
+        return 1;
+    }
+    threads = malloc (producers * sizeof(*threads));
+    tpool = tpool_create (workers);
+    if(threads == NULL || tpool == NULL) {
+        fprintf(stderr, "setup failed\n");
+        return 1;
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    for(i=0; i<producers; i++) {
+        pthread_create (&threads[i], NULL, producer, NULL);
+    }
+    for(i=0; i<producers; i++) {
+        pthread_join (threads[i], NULL);
+    }
+    tpool_wait (tpool, TPOOL_WAIT_NO_OPT);
+    clock_gettime (CLOCK_MONOTONIC, &end);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    long total = (long)producers * jobs_per_producer;
+#ifdef TPOOL_PACKED_LAYOUT
+    const char *layout = "packed";
+#else
+    const char *layout = "aligned";
+#endif
+    printf("layout,producers,workers,jobs,seconds,jobs_per_sec\n");
+    printf("%s,%d,%d,%ld,%.6f,%.0f\n", layout, producers, workers, total, secs, total / secs);
+
+    tpool_destroy (&tpool);
+    free (threads);
+    return 0;
+}
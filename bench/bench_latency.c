@@ -0,0 +1,122 @@
+/**
+ * @file bench_latency.c
+ * @brief Submit to start latency benchmark. Jobs are added one at a time at a fixed interval, and
+ *          each job records how long it took from tpool_add_job to the start of the job. This is
+ *          done for the default mode (adaptive spin, then sleep) and for TPOOL_ATTR_BUSY_POLL. For
+ *          meaningful busy poll numbers, the workers need cores of their own.
+ *
+ *          Usage: bench_latency [workers] [jobs] [interval us]
+ *          Output: CSV, one line per mode with the p50, p99 and p99.9 latencies in ns
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../tpool.h"
+
+#define DEFAULT_WORKERS     2
+#define DEFAULT_JOBS        20000
+#define DEFAULT_INTERVAL_US 50
+
+//a sample, the job fills in the latency
+struct sample {
+    long submit_ns;
+    long latency_ns;
+};
+
+/**
+ * @brief Reads the monotonic clock
+ *
+ * @return long the time in nanoseconds
+ */
+static long now_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+/**
+ * @brief The job records its submit to start latency
+ *
+ * @param arg The sample
+ */
+static void job_fn (void *arg)
+{
+    struct sample *sample = arg;
+    sample->latency_ns = now_ns () - sample->submit_ns;
+}
+
+static int cmp_long (const void *a, const void *b)
+{
+    long x = *(const long*)a, y = *(const long*)b;
+    return (x > y) - (x < y);
+}
+/**
+ * @brief Runs the benchmark for one mode and prints its CSV line
+ *
+ * @param name      The name of the mode
+ * @param flags     The tpool_attr_t flags for the mode
+ * @param workers   The number of worker threads
+ * @param jobs      The number of jobs
+ * @param interval  The interval between the jobs in ns
+ * @return int      0 on success, -1 on failure
+ */
+static int run_mode (const char *name, int flags, int workers, int jobs, long interval)
+{
+    tpool_attr_t attr;
+    struct sample *samples = malloc (jobs * sizeof(*samples));
+    long *lat = malloc (jobs * sizeof(*lat));
+    long next;
+    int i;
+
+    tpool_attr_init (&attr);
+    attr.flags = flags;
+    tpool_t *tpool = tpool_create_ex (workers, &attr);
+    if(samples == NULL || lat == NULL || tpool == NULL) {
+        fprintf(stderr, "%s: setup failed\n", name);
+        free (samples);
+        free (lat);
+        return -1;
+    }
+
+    next = now_ns ();
+    for(i=0; i<jobs; i++) {
+        //pace the submissions, so that the latency and not the throughput is measured
+        while(now_ns () < next) {
+        }
+        next += interval;
+        samples[i].submit_ns = now_ns ();
+        tpool_add_job (tpool, job_fn, &samples[i], NULL, TPOOL_NO_OPT);
+    }
+    tpool_wait (tpool, TPOOL_WAIT_NO_OPT);
+    tpool_destroy (&tpool);
+
+    for(i=0; i<jobs; i++) {
+        lat[i] = samples[i].latency_ns;
+    }
+    qsort (lat, jobs, sizeof(*lat), cmp_long);
+    printf("%s,%d,%d,%ld,%ld,%ld,%ld,%ld\n", name, workers, jobs, interval / 1000,
+           lat[jobs / 2], lat[(long)jobs * 99 / 100], lat[(long)jobs * 999 / 1000], lat[jobs - 1]);
+    fflush (stdout);
+
+    free (samples);
+    free (lat);
+    return 0;
+}
+
+int main (int argc, char **argv)
+{
+    int workers = (argc > 1) ? atoi (argv[1]) : DEFAULT_WORKERS;
+    int jobs = (argc > 2) ? atoi (argv[2]) : DEFAULT_JOBS;
+    long interval = ((argc > 3) ? atol (argv[3]) : DEFAULT_INTERVAL_US) * 1000;
+
+    if(workers <= 0 || jobs <= 0 || interval < 0) {
+        fprintf(stderr, "usage: %s [workers] [jobs] [interval us]\n", argv[0]);
+        return 1;
+    }
+    printf("mode,workers,jobs,interval_us,p50_ns,p99_ns,p999_ns,max_ns\n");
+    if(run_mode ("sleep", TPOOL_ATTR_NO_FLAGS, workers, jobs, interval) ||
+            run_mode ("busy_poll", TPOOL_ATTR_BUSY_POLL, workers, jobs, interval)) {
+        return 1;
+    }
+    return 0;
+}
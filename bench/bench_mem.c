@@ -0,0 +1,139 @@
+/**
+ * @file bench_mem.c
+ * @brief Memory footprint benchmark for large tpools. Creates a tpool with many worker threads
+ *          (1000 by default) for each set of creation attributes, makes every worker run a job so
+ *          that its stack is touched, and reports the virtual memory size and the RSS of the
+ *          process. Each configuration runs in a forked child so that they don't affect each other.
+ *
+ *          Usage: bench_mem [thread count]
+ *          Output: CSV, one line per configuration
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../tpool.h"
+
+#define DEFAULT_THREADS     1000
+
+//a benchmark configuration
+struct config {
+    const char *name;
+    size_t stack_size;
+    size_t guard_size;
+    int stack_mode;
+};
+/**
+ * @brief Reads a field like VmRSS from /proc/self/status
+ *
+ * @param field The field name, including the colon
+ * @return long The value in kB, -1 on failure
+ */
+static long read_status_kb (const char *field)
+{
+    char line[256];
+    long ret = -1;
+    FILE *fp = fopen ("/proc/self/status", "r");
+    if(fp == NULL) {
+        return ret;
+    }
+    while(fgets (line, sizeof(line), fp)) {
+        if(strncmp (line, field, strlen(field)) == 0) {
+            ret = strtol (line + strlen(field), NULL, 10);
+            break;
+        }
+    }
+    fclose (fp);
+    return ret;
+}
+/**
+ * @brief The job touches a few kB of its stack, like a real job would
+ *
+ * @param arg unused
+ */
+static void job_fn (void *arg)
+{
+    volatile char buf[4096];
+    memset ((char*)buf, 0, sizeof(buf));
+    (void)arg;
+    //keep the worker busy for a while, so that the jobs get spread over all the workers
+    usleep (1000);
+}
+/**
+ * @brief Runs one configuration and prints its CSV line. Called in a forked child
+ *
+ * @param cfg       The configuration
+ * @param threads   The number of worker threads
+ * @return int      The exit status for the child
+ */
+static int run_config (const struct config *cfg, int threads)
+{
+    tpool_attr_t attr;
+    int i;
+    long vm_before = read_status_kb ("VmSize:");
+    long rss_before = read_status_kb ("VmRSS:");
+
+    tpool_attr_init (&attr);
+    if(cfg->stack_size) {
+        attr.stack_size = cfg->stack_size;
+    }
+    if(cfg->guard_size != (size_t)-1) {
+        attr.guard_size = cfg->guard_size;
+    }
+    attr.stack_mode = cfg->stack_mode;
+
+    tpool_t *tpool = tpool_create_ex (threads, &attr);
+    if(tpool == NULL) {
+        fprintf(stderr, "%s: tpool_create_ex failed\n", cfg->name);
+        return 1;
+    }
+    for(i=0; i<threads; i++) {
+        tpool_add_job (tpool, job_fn, NULL, NULL, TPOOL_NO_OPT);
+    }
+    tpool_wait (tpool, TPOOL_WAIT_NO_OPT);
+
+    long vm_after = read_status_kb ("VmSize:");
+    long rss_after = read_status_kb ("VmRSS:");
+    printf("%s,%d,%zu,%ld,%ld\n", cfg->name, threads, cfg->stack_size,
+           vm_after - vm_before, rss_after - rss_before);
+    fflush (stdout);
+
+    tpool_destroy (&tpool);
+    return 0;
+}
+
+int main (int argc, char **argv)
+{
+    int threads = (argc > 1) ? atoi (argv[1]) : DEFAULT_THREADS;
+    const struct config configs[] = {
+        { "default",            0,              (size_t)-1, TPOOL_STACK_DEFAULT },
+        { "stack_256k",         256*1024,       (size_t)-1, TPOOL_STACK_DEFAULT },
+        { "stack_64k",          64*1024,        (size_t)-1, TPOOL_STACK_DEFAULT },
+        { "stack_64k_noguard",  64*1024,        0,          TPOOL_STACK_DEFAULT },
+        { "prealloc_64k",       64*1024,        (size_t)-1, TPOOL_STACK_PREALLOC },
+        { "hugepage_2m",        2*1024*1024,    (size_t)-1, TPOOL_STACK_HUGEPAGE },
+    };
+    size_t i;
+    int status;
+
+    if(threads <= 0) {
+        fprintf(stderr, "usage: %s [thread count]\n", argv[0]);
+        return 1;
+    }
+
+    printf("config,threads,stack_size,vm_kb,rss_kb\n");
+    fflush (stdout);
+    for(i=0; i<sizeof(configs)/sizeof(configs[0]); i++) {
+        pid_t pid = fork ();
+        if(pid == 0) {
+            exit (run_config (&configs[i], threads));
+        }
+        else if(pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        waitpid (pid, &status, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,144 @@
+/**
+ * @file bench_shutdown.c
+ * @brief Shutdown time benchmark. Each worker is held by a gate job while the queue is filled with
+ *          TPOOL_CLEANUP_RUN_JOB jobs, then tpool_destroy is called and the gates are opened. The
+ *          time that tpool_destroy takes to drain the queue is reported for each worker count.
+ *
+ *          Usage: bench_shutdown [max workers] [jobs] [job us]
+ *          Output: CSV, one line per worker count (1, 2, 4 ... max workers)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "../tpool.h"
+
+#define DEFAULT_WORKERS     8
+#define DEFAULT_JOBS        100000
+#define DEFAULT_JOB_US      10
+//how long the gates stay closed after tpool_destroy is called
+#define GATE_DELAY_NS       1000000L
+
+static atomic_int gate;
+static atomic_long done;
+static long job_ns;
+
+/**
+ * @brief Reads the monotonic clock
+ *
+ * @return long the time in nanoseconds
+ */
+static long now_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+/**
+ * @brief The gate job holds its worker until the gate is opened
+ *
+ * @param arg unused
+ */
+static void gate_fn (void *arg)
+{
+    (void)arg;
+    while(atomic_load (&gate) == 0) {
+    }
+}
+/**
+ * @brief The queued job burns the CPU for job_ns
+ *
+ * @param arg unused
+ */
+static void job_fn (void *arg)
+{
+    (void)arg;
+    long end = now_ns () + job_ns;
+    while(now_ns () < end) {
+    }
+    atomic_fetch_add (&done, 1);
+}
+/**
+ * @brief Opens the gates a little after tpool_destroy is called, so that the workers see the exit
+ *          flag with the queue still full
+ *
+ * @param arg unused
+ * @return void* NULL
+ */
+static void *opener (void *arg)
+{
+    (void)arg;
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = GATE_DELAY_NS };
+    nanosleep (&ts, NULL);
+    atomic_store (&gate, 1);
+    return NULL;
+}
+/**
+ * @brief Runs the benchmark for one worker count and prints its CSV line
+ *
+ * @param workers   The number of worker threads
+ * @param jobs      The number of queued jobs
+ * @return int      0 on success, -1 on failure
+ */
+static int run (int workers, int jobs)
+{
+    pthread_t thread;
+    long start, end;
+    int i;
+    tpool_t *tpool = tpool_create (workers);
+    if(tpool == NULL) {
+        fprintf(stderr, "tpool_create failed\n");
+        return -1;
+    }
+    atomic_store (&gate, 0);
+    atomic_store (&done, 0);
+    for(i=0; i<workers; i++) {
+        tpool_add_job (tpool, gate_fn, NULL, NULL, TPOOL_NO_OPT);
+    }
+    for(i=0; i<jobs; i++) {
+        tpool_add_job (tpool, job_fn, NULL, NULL, TPOOL_CLEANUP_RUN_JOB);
+    }
+
+    if(pthread_create (&thread, NULL, opener, NULL) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        atomic_store (&gate, 1);
+        tpool_destroy (&tpool);
+        return -1;
+    }
+    start = now_ns ();
+    tpool_destroy (&tpool);
+    end = now_ns ();
+    pthread_join (thread, NULL);
+
+    printf("%d,%d,%ld,%ld,%.3f\n", workers, jobs, job_ns / 1000, atomic_load (&done),
+           (double)(end - start - GATE_DELAY_NS) / 1e6);
+    fflush (stdout);
+    return 0;
+}
+
+int main (int argc, char **argv)
+{
+    int workers = (argc > 1) ? atoi (argv[1]) : DEFAULT_WORKERS;
+    int jobs = (argc > 2) ? atoi (argv[2]) : DEFAULT_JOBS;
+    job_ns = ((argc > 3) ? atol (argv[3]) : DEFAULT_JOB_US) * 1000;
+    int i;
+
+    if(workers <= 0 || jobs <= 0 || job_ns < 0) {
+        fprintf(stderr, "usage: %s [max workers] [jobs] [job us]\n", argv[0]);
+        return 1;
+    }
+    printf("workers,jobs,job_us,jobs_run,shutdown_ms\n");
+    for(i=1; ; i*=2) {
+        if(i > workers) {
+            i = workers;
+        }
+        if(run (i, jobs)) {
+            return 1;
+        }
+        if(i == workers) {
+            break;
+        }
+    }
+    return 0;
+}
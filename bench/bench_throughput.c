@@ -0,0 +1,299 @@
+/**
+ * @file bench_throughput.c
+ * @brief Throughput benchmark suite, meant for comparing builds and queue backends:
+ *          - throughput of empty and small jobs for 1..N producers x 1..M workers (powers of 2,
+ *            and N and M themselves). The producers are released together and the clock stops
+ *            once tpool_wait returns
+ *          - the cost of tpool_create and tpool_destroy for each worker count
+ *          - burst (all the jobs added at once) versus steady (the queue kept at 2 jobs per
+ *            worker) submission of small jobs, with the p50 and p99 queue wait
+ *
+ *          Usage: bench_throughput [max producers] [max workers] [jobs] [csv|json]
+ *          Output: CSV (the default) or a JSON array, one row per measurement. The wait columns
+ *          are -1 where they don't apply
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include "../tpool.h"
+
+#define DEFAULT_PRODUCERS   4
+#define DEFAULT_WORKERS     4
+#define DEFAULT_JOBS        200000
+//the iterations of a small job, roughly 100-200 ns
+#define SMALL_JOB_LOOPS     100
+//the creates and destroys timed per worker count
+#define CREATE_REPEATS      50
+//the queue depth per worker kept by the steady submission
+#define STEADY_DEPTH        2
+
+//a measurement, printed as one row
+struct row {
+    const char *test;
+    const char *job;
+    int producers;
+    int workers;
+    long ops;
+    long ns;
+    long wait_p50_ns;
+    long wait_p99_ns;
+};
+
+//the state shared with the producer threads
+struct producers {
+    tpool_t *tpool;
+    void (*job_fn) (void*);
+    long jobs_per_producer;
+    pthread_barrier_t start;
+};
+
+static int json;
+static int rows;
+
+/**
+ * @brief Reads the monotonic clock
+ *
+ * @return long the time in nanoseconds
+ */
+static long now_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+/**
+ * @brief The empty job, only the tpool overhead is measured
+ *
+ * @param arg Unused
+ */
+static void empty_job (void *arg)
+{
+}
+/**
+ * @brief The small job, a short busy loop
+ *
+ * @param arg Unused
+ */
+static void small_job (void *arg)
+{
+    volatile int i;
+    for(i=0; i<SMALL_JOB_LOOPS; i++) {
+    }
+}
+/**
+ * @brief Prints a row as CSV or as a JSON object
+ *
+ * @param row The row
+ */
+static void print_row (const struct row *row)
+{
+    double sec = row->ns / 1e9;
+    double rate = (row->ns > 0) ? row->ops / sec : 0.0;
+    if(json) {
+        printf("%s\n  {\"test\": \"%s\", \"job\": \"%s\", \"producers\": %d, \"workers\": %d, \"ops\": %ld, "
+               "\"seconds\": %.6f, \"ops_per_sec\": %.0f, \"ns_per_op\": %.1f, \"wait_p50_ns\": %ld, \"wait_p99_ns\": %ld}",
+               (rows) ? "," : "", row->test, row->job, row->producers, row->workers, row->ops,
+               sec, rate, (double)row->ns / row->ops, row->wait_p50_ns, row->wait_p99_ns);
+    }
+    else {
+        printf("%s,%s,%d,%d,%ld,%.6f,%.0f,%.1f,%ld,%ld\n", row->test, row->job, row->producers, row->workers,
+               row->ops, sec, rate, (double)row->ns / row->ops, row->wait_p50_ns, row->wait_p99_ns);
+    }
+    rows++;
+    fflush (stdout);
+}
+/**
+ * @brief The producer thread adds its share of the jobs once all the producers are ready
+ *
+ * @param arg The shared state
+ * @return void* NULL
+ */
+static void *producer (void *arg)
+{
+    struct producers *p = arg;
+    long i;
+    pthread_barrier_wait (&(p->start));
+    for(i=0; i<p->jobs_per_producer; i++) {
+        tpool_add_job (p->tpool, p->job_fn, NULL, NULL, TPOOL_NO_OPT);
+    }
+    return NULL;
+}
+/**
+ * @brief Measures the throughput of one job kind for a producers x workers combination
+ *
+ * @param name      The name of the job kind
+ * @param job_fn    The job
+ * @param producers The number of producer threads
+ * @param workers   The number of worker threads
+ * @param jobs      The total number of jobs
+ * @return int      0 on success, -1 on failure
+ */
+static int run_throughput (const char *name, void (*job_fn)(void*), int producers, int workers, long jobs)
+{
+    struct producers p;
+    pthread_t *threads = malloc (producers * sizeof(*threads));
+    struct row row = {"throughput", name, producers, workers, 0, 0, -1, -1};
+    long start;
+    int i;
+
+    p.tpool = tpool_create (workers);
+    p.job_fn = job_fn;
+    p.jobs_per_producer = jobs / producers;
+    if(threads == NULL || p.tpool == NULL || pthread_barrier_init (&(p.start), NULL, producers + 1) != 0) {
+        fprintf(stderr, "throughput: setup failed\n");
+        free (threads);
+        if(p.tpool) {
+            tpool_destroy (&(p.tpool));
+        }
+        return -1;
+    }
+    for(i=0; i<producers; i++) {
+        pthread_create (&threads[i], NULL, producer, &p);
+    }
+    pthread_barrier_wait (&(p.start));
+    start = now_ns ();
+    for(i=0; i<producers; i++) {
+        pthread_join (threads[i], NULL);
+    }
+    tpool_wait (p.tpool, TPOOL_WAIT_NO_OPT);
+    row.ns = now_ns () - start;
+    row.ops = p.jobs_per_producer * producers;
+
+    tpool_destroy (&(p.tpool));
+    pthread_barrier_destroy (&(p.start));
+    free (threads);
+    print_row (&row);
+    return 0;
+}
+/**
+ * @brief Measures the average cost of tpool_create and of tpool_destroy (of an idle tpool)
+ *
+ * @param workers   The number of worker threads
+ * @return int      0 on success, -1 on failure
+ */
+static int run_create (int workers)
+{
+    struct row create = {"create", "none", 0, workers, CREATE_REPEATS, 0, -1, -1};
+    struct row destroy = {"destroy", "none", 0, workers, CREATE_REPEATS, 0, -1, -1};
+    tpool_t *tpool;
+    long t;
+    int i;
+
+    for(i=0; i<CREATE_REPEATS; i++) {
+        t = now_ns ();
+        tpool = tpool_create (workers);
+        create.ns += now_ns () - t;
+        if(tpool == NULL) {
+            fprintf(stderr, "create: tpool_create failed\n");
+            return -1;
+        }
+        t = now_ns ();
+        tpool_destroy (&tpool);
+        destroy.ns += now_ns () - t;
+    }
+    print_row (&create);
+    print_row (&destroy);
+    return 0;
+}
+/**
+ * @brief Measures the throughput and queue wait of small jobs added by one producer, either all
+ *          at once or at the pace of the workers
+ *
+ * @param steady    0 => burst, else steady
+ * @param workers   The number of worker threads
+ * @param jobs      The number of jobs
+ * @return int      0 on success, -1 on failure
+ */
+static int run_submission (int steady, int workers, long jobs)
+{
+    struct row row = {(steady) ? "steady" : "burst", "small", 1, workers, jobs, 0, -1, -1};
+    tpool_latency_t *lat = malloc (sizeof(*lat));
+    tpool_t *tpool = tpool_create (workers);
+    long start;
+    long i;
+
+    if(lat == NULL || tpool == NULL) {
+        fprintf(stderr, "%s: setup failed\n", row.test);
+        free (lat);
+        if(tpool) {
+            tpool_destroy (&tpool);
+        }
+        return -1;
+    }
+    tpool_set_timing (tpool, 1);
+    start = now_ns ();
+    for(i=0; i<jobs; i++) {
+        //keep just enough jobs queued for the workers
+        while(steady && tpool_queue_depth (tpool) >= STEADY_DEPTH * workers) {
+            sched_yield ();
+        }
+        tpool_add_job (tpool, small_job, NULL, NULL, TPOOL_NO_OPT);
+    }
+    tpool_wait (tpool, TPOOL_WAIT_NO_OPT);
+    row.ns = now_ns () - start;
+
+    tpool_get_latency (tpool, TPOOL_LATENCY_ALL, lat);
+    row.wait_p50_ns = tpool_hist_percentile (&(lat->wait), 50.0);
+    row.wait_p99_ns = tpool_hist_percentile (&(lat->wait), 99.0);
+    tpool_destroy (&tpool);
+    free (lat);
+    print_row (&row);
+    return 0;
+}
+/**
+ * @brief The next count of a 1, 2, 4, ... max sweep
+ *
+ * @param n     The current count
+ * @param max   The last count
+ * @return int  The next count, > max at the end
+ */
+static int next_count (int n, int max)
+{
+    return (n < max && n * 2 > max) ? max : n * 2;
+}
+
+int main (int argc, char **argv)
+{
+    int max_producers = (argc > 1) ? atoi (argv[1]) : DEFAULT_PRODUCERS;
+    int max_workers = (argc > 2) ? atoi (argv[2]) : DEFAULT_WORKERS;
+    long jobs = (argc > 3) ? atol (argv[3]) : DEFAULT_JOBS;
+    int producers, workers;
+
+    json = (argc > 4 && strcmp (argv[4], "json") == 0);
+    if(max_producers <= 0 || max_workers <= 0 || jobs < max_producers ||
+            (argc > 4 && !json && strcmp (argv[4], "csv") != 0)) {
+        fprintf(stderr, "usage: %s [max producers] [max workers] [jobs] [csv|json]\n", argv[0]);
+        return 1;
+    }
+    if(json) {
+        printf("[");
+    }
+    else {
+        printf("test,job,producers,workers,ops,seconds,ops_per_sec,ns_per_op,wait_p50_ns,wait_p99_ns\n");
+    }
+
+    for(producers=1; producers<=max_producers; producers=next_count (producers, max_producers)) {
+        for(workers=1; workers<=max_workers; workers=next_count (workers, max_workers)) {
+            if(run_throughput ("empty", empty_job, producers, workers, jobs) ||
+                    run_throughput ("small", small_job, producers, workers, jobs)) {
+                return 1;
+            }
+        }
+    }
+    for(workers=1; workers<=max_workers; workers=next_count (workers, max_workers)) {
+        if(run_create (workers)) {
+            return 1;
+        }
+    }
+    if(run_submission (0, max_workers, jobs) || run_submission (1, max_workers, jobs)) {
+        return 1;
+    }
+
+    if(json) {
+        printf("\n]\n");
+    }
+    return 0;
+}
@@ -0,0 +1,117 @@
+/**
+ * @file tpool_top.c
+ * @brief Live viewer for the stats segment of a tpool (tpool_attr_t.shm_name). Attaches to the
+ *          segment read only and redraws every interval: the throughput and queue depth of the
+ *          tpool, its latency percentiles if the timing is on, and the state, utilization and
+ *          job rate of each worker, computed from the difference between two snapshots.
+ *
+ *          Usage: tpool_top <segment name> [interval ms]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "../tpool.h"
+
+#define DEFAULT_INTERVAL_MS 1000
+
+static const char *state_names[] = {"running", "spinning", "parked"};
+
+/**
+ * @brief Prints the p50, p99 and max of a latency histogram
+ *
+ * @param name The name of the histogram
+ * @param hist The histogram
+ */
+static void print_hist (const char *name, const tpool_hist_t *hist)
+{
+    if(hist->count == 0) {
+        return;
+    }
+    printf ("%-5s p50 %10.1f us  p99 %10.1f us  max %10.1f us\n", name,
+            tpool_hist_percentile (hist, 50.0) / 1e3, tpool_hist_percentile (hist, 99.0) / 1e3,
+            hist->max_ns / 1e3);
+}
+
+int main (int argc, char **argv)
+{
+    tpool_shm_t *shm;
+    tpool_shm_stats_t cur, prev;
+    tpool_worker_stats_t *workers, *prev_workers;
+    long interval_ms = DEFAULT_INTERVAL_MS;
+    int i;
+
+    if(argc < 2) {
+        fprintf (stderr, "usage: %s <segment name> [interval ms]\n", argv[0]);
+        return 1;
+    }
+    if(argc > 2) {
+        interval_ms = atol (argv[2]);
+        if(interval_ms <= 0) {
+            interval_ms = DEFAULT_INTERVAL_MS;
+        }
+    }
+    shm = tpool_shm_attach (argv[1]);
+    if(shm == NULL) {
+        fprintf (stderr, "can't attach to %s: %s\n", argv[1], strerror (errno));
+        return 1;
+    }
+    if(tpool_shm_read (shm, &cur, NULL, 0) == -1) {
+        perror("tpool_shm_read");
+        tpool_shm_detach (&shm);
+        return 1;
+    }
+    workers = calloc (cur.workers, sizeof(*workers));
+    prev_workers = calloc (cur.workers, sizeof(*prev_workers));
+    if(workers == NULL || prev_workers == NULL) {
+        perror("calloc");
+        free(workers);
+        free(prev_workers);
+        tpool_shm_detach (&shm);
+        return 1;
+    }
+    tpool_shm_read (shm, &prev, prev_workers, cur.workers);
+
+    while(1) {
+        usleep (interval_ms * 1000);
+        if(tpool_shm_read (shm, &cur, workers, prev.workers) == -1) {
+            perror("tpool_shm_read");
+            break;
+        }
+        double dt = (cur.time_ns - prev.time_ns) / 1e9;
+
+        //clear the screen and go home
+        printf ("\033[H\033[2J");
+        printf ("tpool pid %ld  workers %d  interval %ld ms%s\n", cur.pid, cur.workers,
+                cur.interval_ns / 1000000L, (cur.closed) ? "  (closed)" : "");
+        printf ("jobs/s %12.0f  submitted %lu  completed %lu  rejected %lu  dropped %lu\n",
+                (dt > 0) ? (cur.stats.completed - prev.stats.completed) / dt : 0.0,
+                cur.stats.submitted, cur.stats.completed, cur.stats.rejected, cur.stats.dropped);
+        printf ("queue  %ld  max %ld  avg %.2f\n", cur.queue.depth, cur.queue.max_depth, cur.queue.avg_depth);
+        print_hist ("wait", &(cur.latency.wait));
+        print_hist ("exec", &(cur.latency.exec));
+        printf ("\n%6s %-9s %7s %12s %10s %10s\n", "worker", "state", "util%", "jobs/s", "wakeups", "empty");
+        for(i=0; i<cur.workers; i++) {
+            tpool_worker_stats_t *w = &(workers[i]);
+            tpool_worker_stats_t *p = &(prev_workers[i]);
+            unsigned long busy = w->busy_ns - p->busy_ns;
+            unsigned long total = busy + (w->idle_ns - p->idle_ns);
+            printf ("%6d %-9s %7.1f %12.0f %10lu %10lu\n", i,
+                    (w->state >= 0 && w->state <= TPOOL_WORKER_PARKED) ? state_names[w->state] : "?",
+                    (total) ? 100.0 * busy / total : 0.0,
+                    (dt > 0) ? (w->jobs - p->jobs) / dt : 0.0,
+                    w->wakeups - p->wakeups, w->empty_wakeups - p->empty_wakeups);
+        }
+        fflush (stdout);
+        if(cur.closed) {
+            break;
+        }
+        prev = cur;
+        memcpy (prev_workers, workers, cur.workers * sizeof(*workers));
+    }
+    free(workers);
+    free(prev_workers);
+    tpool_shm_detach (&shm);
+    return 0;
+}
@@ -20,12 +20,31 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE. */
 
+//for dladdr
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include "tpool.h"
 #include <pthread.h>
 #include <semaphore.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
 #include <assert.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dlfcn.h>
 /************************************************************************************/
 //remove asserts in non debug build
 #if !defined(TPOOL_DEBUG) && !defined(NDEBUG)
@@ -37,6 +56,142 @@ SOFTWARE. */
 
 #define TPOOL_TRUE          1
 #define TPOOL_FALSE         0
+
+//how long an idle extra worker waits for a job before it checks if it can retire
+#define TPOOL_EXTRA_LINGER_NS   10000000L
+
+//the huge page size used for TPOOL_STACK_HUGEPAGE
+#define TPOOL_HUGEPAGE_SIZE     (2UL*1024*1024)
+//rounds x up to a multiple of the power of 2 a
+#define TPOOL_ROUND_UP(x,a)     (((x) + (a) - 1) & ~((a) - 1))
+
+//the default upper limit for the spin budget of the workers
+#define TPOOL_SPIN_MAX_NS       50000L
+//how many times a spinning worker polls before it checks the clock
+#define TPOOL_SPIN_POLLS        32
+//the weight of a new sample in the spin EWMAs is 1/2^TPOOL_EWMA_SHIFT
+#define TPOOL_EWMA_SHIFT        3
+//the virtual time of a tenant advances by (cost << TPOOL_VTIME_SHIFT) / weight for each job
+#define TPOOL_VTIME_SHIFT       4
+//the cost estimate of a tenant's job before any has completed
+#define TPOOL_COST_INIT_NS      1000L
+//the default interval of the admission control, as recommended for CoDel
+#define TPOOL_SHED_INTERVAL_NS  100000000L
+//the tenant of a job, see TPOOL_OPT_TENANT
+#define TPOOL_TENANT_OF(opt)    (((opt) >> 16) & (TPOOL_MAX_TENANTS - 1))
+//the class of a job, see TPOOL_OPT_CLASS
+#define TPOOL_CLASS_OF(opt)     (((opt) >> 20) & (TPOOL_MAX_CLASSES - 1))
+//the token buckets are kept in fixed point, one token is TPOOL_TOKEN units. This way a bucket
+//refills by rate units per ns
+#define TPOOL_TOKEN             1000000000L
+//increments a counter that only its own worker writes, so no atomic read-modify-write is needed
+#define TPOOL_STAT_ADD(counter, n)  atomic_store_explicit (&(counter), atomic_load_explicit (&(counter), memory_order_relaxed) + (n), memory_order_relaxed)
+//the events of the tracer
+#define TPOOL_TRACE_ENQUEUE     0
+#define TPOOL_TRACE_START       1
+#define TPOOL_TRACE_END         2
+#define TPOOL_TRACE_PARK        3
+#define TPOOL_TRACE_UNPARK      4
+//the smallest ring of the tracer, so that the rings stay a multiple of the cache line
+#define TPOOL_TRACE_MIN_EVENTS  64L
+//the size of the profiler table of each worker (a power of 2). The job functions that don't fit
+//are counted together in an extra slot
+#define TPOOL_PROF_BITS         6
+#define TPOOL_PROF_SLOTS        (1 << TPOOL_PROF_BITS)
+//the sides of the queue lock for TPOOL_ATTR_LOCK_STATS
+#define TPOOL_LOCK_PRODUCER     0
+#define TPOOL_LOCK_CONSUMER     1
+//identifies a stats segment ("tpoolshm") and its layout
+#define TPOOL_SHM_MAGIC         0x74706f6f6c73686dUL
+#define TPOOL_SHM_VERSION       1
+//the default publishing interval of the stats segment
+#define TPOOL_SHM_INTERVAL_NS   100000000L
+//how many times tpool_shm_read retries while a write is in progress
+#define TPOOL_SHM_RETRIES       1000
+//the name of a tpool when tpool_attr_t.name is NULL
+#define TPOOL_NAME_DEFAULT      "tpool"
+//the spin hit ratio is kept in fixed point, TPOOL_HIT_ONE => every spin was a hit
+#define TPOOL_HIT_ONE           1024L
+
+//the longest backoff (in TPOOL_CPU_RELAX calls) of a worker that polls an empty queue
+#define TPOOL_POLL_BACKOFF_MAX  64
+//how long a worker waits in umwait (in TSC ticks) when the CPU supports it
+#define TPOOL_UMWAIT_TICKS      10000ULL
+
+//tells the CPU that this is a spin loop
+#if defined(__x86_64__) || defined(__i386__)
+#define TPOOL_CPU_RELAX()       __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define TPOOL_CPU_RELAX()       __asm__ __volatile__ ("yield")
+#else
+#define TPOOL_CPU_RELAX()       do {} while(0)
+#endif
+
+//USDT probes (provider tpool) for bpftrace, perf and systemtap, see bpftrace/. Each probe is a nop
+//plus a .note.stapsdt entry that says where its arguments are, so it costs next to nothing while
+//no tracer is attached. sys/sdt.h is used when it is available, else the notes are emitted the
+//same way here on x86_64 and aarch64. Elsewhere, or with TPOOL_NO_PROBES, the probes compile to
+//nothing
+#if !defined(TPOOL_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TPOOL_PROBE3(name, a0, a1, a2)          DTRACE_PROBE3(tpool, name, a0, a1, a2)
+#define TPOOL_PROBE4(name, a0, a1, a2, a3)      DTRACE_PROBE4(tpool, name, a0, a1, a2, a3)
+#endif
+#endif
+
+#if !defined(TPOOL_NO_PROBES) && !defined(TPOOL_PROBE3) && defined(__GNUC__) && \
+        (defined(__x86_64__) || defined(__aarch64__))
+//the note layout of sys/sdt.h: the probe address, the base used to correct it for prelinking, no
+//semaphore, the provider, the name and the arguments (all of them 8 bytes, in registers). The
+//operands are named p0.. since a0.. are taken by the macro parameters
+#define TPOOL_PROBE_ASM(name, args, ...) \
+    __asm__ __volatile__ ("990: nop\n" \
+                          ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+                          ".balign 4\n" \
+                          ".4byte 992f-991f, 994f-993f, 3\n" \
+                          "991: .asciz \"stapsdt\"\n" \
+                          "992: .balign 4\n" \
+                          "993: .8byte 990b\n" \
+                          ".8byte _.stapsdt.base\n" \
+                          ".8byte 0\n" \
+                          ".asciz \"tpool\"\n" \
+                          ".asciz \"" #name "\"\n" \
+                          ".asciz \"" args "\"\n" \
+                          "994: .balign 4\n" \
+                          ".popsection\n" \
+                          ".ifndef _.stapsdt.base\n" \
+                          ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+                          ".weak _.stapsdt.base\n" \
+                          ".hidden _.stapsdt.base\n" \
+                          "_.stapsdt.base: .space 1\n" \
+                          ".size _.stapsdt.base, 1\n" \
+                          ".popsection\n" \
+                          ".endif\n" \
+                          :: __VA_ARGS__)
+#define TPOOL_PROBE3(name, a0, a1, a2) \
+    TPOOL_PROBE_ASM(name, "8@%[p0] 8@%[p1] 8@%[p2]", \
+                    [p0] "r" ((unsigned long)(a0)), [p1] "r" ((unsigned long)(a1)), [p2] "r" ((unsigned long)(a2)))
+#define TPOOL_PROBE4(name, a0, a1, a2, a3) \
+    TPOOL_PROBE_ASM(name, "8@%[p0] 8@%[p1] 8@%[p2] -8@%[p3]", \
+                    [p0] "r" ((unsigned long)(a0)), [p1] "r" ((unsigned long)(a1)), [p2] "r" ((unsigned long)(a2)), \
+                    [p3] "r" ((long)(a3)))
+#endif
+
+#ifndef TPOOL_PROBE3
+#define TPOOL_PROBE3(name, a0, a1, a2)          do {} while(0)
+#define TPOOL_PROBE4(name, a0, a1, a2, a3)      do {} while(0)
+#endif
+
+//the struct members that are written by different sides (producers, consumers) are kept on
+//separate cache lines. Define TPOOL_PACKED_LAYOUT to turn this off, e.g. to compare the two
+//layouts with perf c2c
+#define TPOOL_CACHE_LINE        64
+#ifndef TPOOL_PACKED_LAYOUT
+#define TPOOL_CACHE_ALIGNED     _Alignas(TPOOL_CACHE_LINE)
+#else
+#define TPOOL_CACHE_ALIGNED
+#endif
 /************************************************************************************/
 //private structures
 /**
@@ -45,53 +200,560 @@ SOFTWARE. */
  * @var destructor  The optional function pointer for the destructor
  * @var arg         The optional pointer that holds the pointer to the arg
  * @var opt         The bitwise options data
+ * @var group       The group that the job is a member of, NULL if none
+ * @var charge      The cost that the tenant was charged when the job was dequeued, in ns
+ * @var enq_ns      The _tpool_now_ns time that the job was added at, only set for admission control
+ *                      and for the latency histograms, else 0
+ * @var trace_id    The id of the job in the trace, 0 if the tracer is off
  */
 struct _tpool_job_s {
     void (*fn_ptr) (void*);
     void (*destructor) (void*);
     void *arg;
     int opt;
+    struct _tpool_group_s   *group;
+    long                    charge;
+    long                    enq_ns;
+    unsigned long           trace_id;
 
     struct _tpool_job_s     *prev;
     struct _tpool_job_s     *next;
 };
 /**
- * @brief           The struct that holds the queue of the jobs. Jobs enter the queue from the back
- *                      and exit the queue from the front
+ * @brief           The queue of a tenant. Jobs enter the queue from the back and exit the queue
+ *                      from the front. Protected by the lock of the queue that it is a part of. The
+ *                      back is written by the producers, and is on a cache line of its own apart
+ *                      from the members that the consumers write
  * @var front       The front of the queue - the jobs exit the queue through this side
  * @var back        The back of the queue - the jobs enter the queue through this side
+ * @var weight      The weight of the tenant
+ * @var vtime       The virtual time of the tenant, i.e. the worker time that it has been charged,
+ *                      scaled by its weight. Only advanced with the lock held, except for the
+ *                      corrections once the jobs complete
+ * @var cost_ns     EWMA of the run time of the tenant's jobs, charged when a job is dequeued
+ * 
+ */
+struct _tpool_subq_s {
+    TPOOL_CACHE_ALIGNED struct _tpool_job_s *front;
+    atomic_int              weight;
+    atomic_long             vtime;
+    atomic_long             cost_ns;
+    TPOOL_CACHE_ALIGNED struct _tpool_job_s *back;
+};
+/**
+ * @brief           The queue and the token bucket of a job class. Protected by the lock of the
+ *                      queue that it is a part of. As for the tenants, the back (and the count,
+ *                      which the producers write too) is on a cache line of its own
+ * @var front       The front of the queue
+ * @var back        The back of the queue
+ * @var count       The number of jobs in the queue
+ * @var rate        The refill rate of the bucket in tokens per second, 0 => unlimited
+ * @var burst       The size of the bucket in TPOOL_TOKEN units
+ * @var tokens      The tokens in the bucket in TPOOL_TOKEN units, as of last_ns
+ * @var last_ns     The _tpool_now_ns time that the bucket was last refilled at
+ * 
+ */
+struct _tpool_class_s {
+    TPOOL_CACHE_ALIGNED struct _tpool_job_s *front;
+    long                    rate;
+    long                    burst;
+    long                    tokens;
+    long                    last_ns;
+    TPOOL_CACHE_ALIGNED struct _tpool_job_s *back;
+    long                    count;
+};
+/**
+ * @brief           The queue lock statistics of one side, see tpool_lock_stats_t. Only written with
+ *                      the lock held, but read without it
+ */
+struct _tpool_lockstat_s {
+    atomic_ulong            acquired;
+    atomic_ulong            contended;
+    atomic_ulong            wait_ns;
+    atomic_ulong            hold_ns;
+};
+/**
+ * @brief           The struct that holds the queue of the jobs, one queue for each tenant and one
+ *                      for each job class (other than 0). The next job is taken from the tenant,
+ *                      or the class whose first job belongs to the tenant, with the lowest virtual
+ *                      time (start time fair queuing), so that each tenant gets a share of the
+ *                      worker time that is proportional to its weight. A class that is out of
+ *                      tokens is blocked until its next refill
  * @var lock        The pthread mutex lock for thread safe access of the queue
+ * @var len         The number of jobs in the queue. Only written with lock held, but can be read
+ *                      without it, e.g. by workers that poll the queue
+ * @var len_max     The high-water mark of len since len_since_us. Written with lock held
+ * @var len_area    The integral of len over the coarse clock since len_since_us, in jobs * us. It
+ *                      is brought up to date by the first change after each tick of the clock,
+ *                      with the length held since the previous update, so it is exact to within
+ *                      a tick
+ * @var len_last_us The coarse clock time that len_area was last brought up to
+ * @var len_since_us The coarse clock time that the high-water mark and the average were reset at
+ * @var active      The bitmask of the tenants that have queued jobs
+ * @var vclock      The virtual time of the last tenant that a job was taken from. A tenant that
+ *                      becomes active starts from here, so that it can't make up for its idle time
+ * @var fair        TPOOL_TRUE once more than one tenant is used. Until then, no time is charged
+ * @var held        The number of queued jobs of the blocked classes, which can't be started. Only
+ *                      written with lock held. len - held jobs are ready
+ * @var refill_ns   The _tpool_now_ns time that the first blocked class gets a token at
+ * @var ready       The bitmask of the classes that have queued jobs and are not blocked
+ * @var blocked     The bitmask of the classes that have queued jobs and no tokens
+ * @var unblocked   Set when a refill unblocks a class, so that more workers can be woken up
+ * @var unlimited   TPOOL_TRUE once the tpool shuts down, the classes are no longer limited and
+ *                      no jobs are shed
+ * @var shed_target The target queue delay of the admission control in ns, 0 => disabled
+ * @var shed_interval The interval of the admission control in ns
+ * @var shed_mode   One of the TPOOL_SHED_* values
+ * @var overloaded  TPOOL_TRUE while the admission control sheds jobs. Read by the producers in
+ *                      TPOOL_SHED_REJECT mode
+ * @var first_above The time at which the queue delay will have been above the target for an
+ *                      interval, 0 if it is below the target
+ * @var lock_stats  TPOOL_TRUE if the lock is instrumented (TPOOL_ATTR_LOCK_STATS)
+ * @var locked_ns   The _tpool_now_ns time that the lock was taken at, for the hold time
+ * @var lockstat    The lock statistics of the producers and of the consumers
+ * @var sub         The queue of each tenant
+ * @var cls         The queue and token bucket of each class, 0 is not used
  * 
  */
 struct _tpool_q_s {
-    struct _tpool_job_s     *front;
-    struct _tpool_job_s     *back;
-    pthread_mutex_t         lock;
+    TPOOL_CACHE_ALIGNED pthread_mutex_t     lock;
+    atomic_long                             len;
+    atomic_long                             len_max;
+    atomic_ulong                            len_area;
+    atomic_long                             len_last_us;
+    atomic_long                             len_since_us;
+    unsigned int                            active;
+    long                                    vclock;
+    atomic_int                              fair;
+    atomic_long                             held;
+    atomic_long                             refill_ns;
+    unsigned int                            ready;
+    unsigned int                            blocked;
+    atomic_int                              unblocked;
+    int                                     unlimited;
+    long                                    shed_target;
+    long                                    shed_interval;
+    int                                     shed_mode;
+    atomic_int                              overloaded;
+    long                                    first_above;
+    int                                     lock_stats;
+    long                                    locked_ns;
+    TPOOL_CACHE_ALIGNED struct _tpool_lockstat_s lockstat[2];
+    TPOOL_CACHE_ALIGNED struct _tpool_subq_s sub[TPOOL_MAX_TENANTS];
+    struct _tpool_class_s                   cls[TPOOL_MAX_CLASSES];
+};
+/**
+ * @brief           The counters of a worker. Only written by the worker itself, and kept on a cache
+ *                      line of their own, since the producers write the park links of the worker
+ * @var jobs        The number of jobs run
+ * @var busy_ns     The time spent outside of _tpool_worker_idle, up to since_ns
+ * @var idle_ns     The time spent in _tpool_worker_idle, up to since_ns
+ * @var wakeups     The number of wakeups from a park
+ * @var empty_wakeups The number of wakeups that found no job
+ * @var since_ns    The _tpool_now_ns time of the last switch between busy and idle
+ * 
+ */
+struct _tpool_wstats_s {
+    atomic_ulong            jobs;
+    atomic_ulong            busy_ns;
+    atomic_ulong            idle_ns;
+    atomic_ulong            wakeups;
+    atomic_ulong            empty_wakeups;
+    atomic_long             since_ns;
+};
+/**
+ * @brief           A latency histogram, see tpool_hist_t. Written by its own worker only, except
+ *                      for the shared one of the tpool
+ */
+struct _tpool_hist_s {
+    atomic_ulong            count;
+    atomic_ulong            sum_ns;
+    atomic_ulong            max_ns;
+    atomic_ulong            buckets[TPOOL_HIST_BUCKETS];
+};
+/**
+ * @brief           The latency histograms of a worker
+ * @var wait        The time from tpool_add_job to the start of the job
+ * @var exec        The time spent in the job function
+ */
+struct _tpool_lat_s {
+    TPOOL_CACHE_ALIGNED struct _tpool_hist_s wait;
+    struct _tpool_hist_s    exec;
+};
+/**
+ * @brief           The profile of a job function in the profiler table, see tpool_prof_entry_t
+ * @var fn          The job function, 0 for a free slot
+ */
+struct _tpool_prof_slot_s {
+    atomic_uintptr_t        fn;
+    atomic_ulong            calls;
+    atomic_ulong            wall_ns;
+    atomic_ulong            max_ns;
+    atomic_ulong            cpu_ns;
+};
+/**
+ * @brief           The profiler table of a worker, open addressing with linear probing on fn.
+ *                      Written by its own worker only, except for the shared one of the tpool
+ * @var slot        The slots, and the one for the job functions that don't fit last
+ */
+struct _tpool_prof_s {
+    TPOOL_CACHE_ALIGNED struct _tpool_prof_slot_s slot[TPOOL_PROF_SLOTS + 1];
+};
+/**
+ * @brief           An event of the tracer. The members are written one by one, so seq works like a
+ *                      seqlock: it is odd while the event is being written, so that
+ *                      tpool_trace_dump can skip the events that are overwritten while it reads them
+ * @var seq         2 * (the index of the event in the ring) + 2 once written
+ * @var ts_ns       The _tpool_now_ns time of the event
+ * @var id          The trace_id of the job, 0 if none
+ * @var fn          The job function, 0 if none
+ * @var tid         The thread id of the thread that recorded the event
+ * @var type        One of the TPOOL_TRACE_* values
+ */
+struct _tpool_trace_ev_s {
+    atomic_ulong            seq;
+    atomic_long             ts_ns;
+    atomic_ulong            id;
+    atomic_uintptr_t        fn;
+    atomic_int              tid;
+    atomic_int              type;
+};
+/**
+ * @brief           A ring of trace events, overwritten from the oldest event once it is full. Each
+ *                      worker has its own, written by the worker only. The shared one of the tpool
+ *                      is written by all the other threads, which claim slots with an atomic add
+ * @var head        The number of events ever recorded, the next one goes to head & mask
+ * @var mask        The size of the ring - 1, the size is a power of 2
+ * @var tid         The thread id of the worker, 0 for the shared ring
+ * @var ev          The events
+ */
+struct _tpool_trace_ring_s {
+    TPOOL_CACHE_ALIGNED atomic_ulong head;
+    unsigned long           mask;
+    atomic_int              tid;
+    struct _tpool_trace_ev_s *ev;
+};
+/**
+ * @brief           The layout of the stats segment. Only the monitor thread of the tpool writes it,
+ *                      under the seqlock seq
+ * @var magic       TPOOL_SHM_MAGIC, written last once the segment is set up
+ * @var version     TPOOL_SHM_VERSION
+ * @var tcount      The number of entries in workers
+ * @var snap_size   sizeof(tpool_shm_stats_t), to catch readers built with another layout
+ * @var worker_size sizeof(tpool_worker_stats_t)
+ * @var seq         The sequence of the seqlock, odd while a snapshot is being written
+ * @var snap        The snapshot of the tpool
+ * @var workers     The stats of each worker, part of the snapshot
+ */
+struct _tpool_shm_seg_s {
+    atomic_ulong            magic;
+    int                     version;
+    int                     tcount;
+    int                     snap_size;
+    int                     worker_size;
+    TPOOL_CACHE_ALIGNED atomic_ulong seq;
+    tpool_shm_stats_t       snap;
+    tpool_worker_stats_t    workers[];
+};
+/**
+ * @brief           The struct that is typedef'd to tpool_shm_t
+ * @var seg         The read only mapping of the segment
+ * @var size        The size of the mapping
+ */
+struct _tpool_shm_s {
+    const struct _tpool_shm_seg_s *seg;
+    size_t                  size;
+};
+/**
+ * @brief           The per worker state. Each worker is on its own cache line(s), since it writes
+ *                      its spin state all the time
+ * @var tpool       The tpool that the worker belongs to
+ * @var thread      The pthread handle of the worker
+ * @var park_sem    The semaphore that the worker sleeps on when it is parked
+ * @var park_next   The next (less recently parked) worker in the park stack
+ * @var park_prev   The previous (more recently parked) worker in the park stack
+ * @var parked      TPOOL_TRUE while the worker is in the park stack. The park members are
+ *                      protected by the park_lock of the tpool
+ * @var state       One of the TPOOL_WORKER_* values, only for the stats
+ * @var spin_budget_ns How long the worker spins for a job before it parks
+ * @var gap_ns      EWMA of how long the worker was idle before a job arrived
+ * @var hit_ratio   EWMA of the fraction of spins that got a job, TPOOL_HIT_ONE => all of them
+ * @var spin_hits   The number of spins that got a job
+ * @var spin_misses The number of spins that ended up sleeping
+ * @var woken       TPOOL_TRUE after a wakeup, until the worker has tried to get a job
+ * @var extra       TPOOL_TRUE for the extra workers, whose spin budget stays at 0
+ * @var stats       The counters of the worker
+ * @var lat         The latency histograms of the worker, NULL for the extra workers, which
+ *                      record into the shared ones of the tpool
+ * @var trace       The trace ring of the worker, NULL if there is no tracer or for the extra
+ *                      workers, which record into the shared ring
+ * @var prof        The profiler table of the worker, NULL for the extra workers
+ * @var tid         The kernel thread id of the worker, published for the watchdog
+ * @var job_start_us The _tpool_coarse_us time at which the current job started, 0 => no job.
+ *                      Only published if the tpool has a watchdog
+ * @var job_fn      The function of the current job
+ * @var job_arg     The argument of the current job
+ * @var job_seen    The job_start_us of the last job that the watchdog reported, only used by
+ *                      the monitor thread
+ * 
+ */
+struct _tpool_worker_s {
+    TPOOL_CACHE_ALIGNED struct _tpool_s *tpool;
+    pthread_t               thread;
+    sem_t                   park_sem;
+    struct _tpool_worker_s  *park_next;
+    struct _tpool_worker_s  *park_prev;
+    int                     parked;
+    atomic_int              state;
+    atomic_long             spin_budget_ns;
+    long                    gap_ns;
+    long                    hit_ratio;
+    atomic_ulong            spin_hits;
+    atomic_ulong            spin_misses;
+    int                     woken;
+    int                     extra;
+    struct _tpool_lat_s     *lat;
+    struct _tpool_trace_ring_s *trace;
+    struct _tpool_prof_s    *prof;
+    atomic_int              tid;
+    atomic_long             job_start_us;
+    atomic_uintptr_t        job_fn;
+    atomic_uintptr_t        job_arg;
+    long                    job_seen;
+    TPOOL_CACHE_ALIGNED struct _tpool_wstats_s stats;
 };
 //the actual threadpool struct
 /**
- * @brief           The struct that is typedef'd to tpool_t
- * @var tpool_sem   The sempahore for synchronising the worker threads
- * @var queue       The instance of the queue structure
+ * @brief           The struct that is typedef'd to tpool_t. The members are grouped by who writes
+ *                      them, each group starting on its own cache line: the read-mostly members,
+ *                      then the ones written by the producers, the ones written by the consumers,
+ *                      the idle workers, the queue, and the cold ones used by the waits. Allocated
+ *                      with aligned_alloc for this
  * @var tcount      Holds the number of threads in this tpool
- * @var threads     Pointer to the array of pthread_t for each worker thread
+ * @var workers     Pointer to the array of per worker state, one for each worker thread
  * @var status      TPOOL_TRUE => tpool initialised, else not initialised
- * @var exit_flag   Holds TPOOL_TRUE if tpool_destroy is called
+ * @var exit_flag   Holds TPOOL_TRUE once tpool_shutdown (or tpool_destroy) is called
+ * @var paused      Holds TPOOL_TRUE between tpool_pause and tpool_resume
+ * @var shutdown_mode  The TPOOL_SHUTDOWN_* mode, written before exit_flag is set
+ * @var shutdown_deadline The _tpool_now_ns time until which TPOOL_SHUTDOWN_DEADLINE performs jobs
+ * @var wait_count  The number of threads that are blocked in tpool_wait or tpool_group_wait
+ * @var extra_max   The maximum number of extra workers
+ * @var stack_size  The stack size of the workers, 0 => system default
+ * @var guard_size  The guard size of the workers
+ * @var stack_mem   The region that the worker stacks are carved out of, NULL if pthread_create
+ *                      allocates them
+ * @var stack_mem_size The size of stack_mem
+ * @var spin_max_ns The upper limit for the spin budget of the workers
+ * @var flags       The TPOOL_ATTR_* flags that the tpool was created with
+ * @var sched_policy   The scheduling policy of the workers, TPOOL_SCHED_INHERIT after a fallback
+ * @var sched_priority The static priority of the workers for SCHED_FIFO and SCHED_RR
+ * @var nice        The nice value of the workers, 0 => unchanged
+ * @var timing      TPOOL_TRUE while the jobs are timestamped for the latency histograms
+ * @var lat_shared  The latency histograms of the threads that are not regular workers, which
+ *                      follow the ones of the workers in the same block as the workers array
+ * @var profiling   TPOOL_TRUE while the job functions are profiled
+ * @var prof_shared The profiler table of the threads that are not regular workers, which follows
+ *                      the ones of the workers after the latency histograms
+ * @var trace       The trace rings, one per worker and the shared one last, NULL if there is no
+ *                      tracer. They follow the profiler tables in the same block
+ * @var trace_count The number of trace rings
+ * @var watchdog_ns The watchdog threshold, 0 => no watchdog
+ * @var watchdog_fn The callback for the stuck jobs, NULL => a line on stderr
+ * @var watchdog_arg The last argument of watchdog_fn
+ * @var submitted   The number of jobs that have been added
+ * @var completed   The number of jobs that have completed (or been discarded). The tpool is idle
+ *                      when this is equal to submitted
+ * @var rejected    The number of sheddable jobs that tpool_add_job turned away
+ * @var trace_seq   The last trace_id given to a job
+ * @var dropped     The number of sheddable jobs that were dropped from the queue
+ * @var running     The number of jobs being run (and of workers about to dequeue one), for
+ *                      tpool_pause
+ * @var spinning    The number of workers that are spinning for a job
+ * @var timer       TPOOL_TRUE while a parked worker is set to wake up at the next token refill
+ * @var parked      The number of workers in the park stack
+ * @var park_lock   The mutex that protects the park stack
+ * @var park_top    The top of the park stack, i.e. the most recently parked worker. The stack is
+ *                      linked through the workers, so that a worker can take itself out of it
+ * @var queue       The instance of the queue structure
+ * @var wait_lock   The mutex that protects the wait_cond condition variable
+ * @var wait_cond   Signalled when a job completes or is added while there are waiters, or when
+ *                      an extra worker exits
+ * @var blocking    The number of open blocking regions (tpool_blocking_begin)
+ * @var extra_count The number of extra workers that compensate for the blocking regions. Only
+ *                      modified with wait_lock held
+ * @var extra_stats The counters of the extra workers that have retired, protected by wait_lock
+ * @var monitor     The monitor thread, which runs the watchdog and publishes the stats segment
+ * @var monitor_lock The mutex that protects monitor_stop
+ * @var monitor_cond The condition variable that the monitor thread sleeps on between its rounds
+ * @var monitor_stop TPOOL_TRUE once the monitor thread should exit
+ * @var monitor_on  TPOOL_TRUE if the monitor thread is running
+ * @var shm         The stats segment, NULL if there is none
+ * @var shm_size    The size of the stats segment
+ * @var shm_name    The name of the stats segment (a copy)
+ * @var shm_interval_ns The publishing interval of the stats segment
+ * @var name        The name of the tpool, for the labels of its metrics
  * 
  */
 struct _tpool_s {
-    sem_t                   tpool_sem;
-    struct _tpool_q_s       queue;
-    int                     tcount;
-    pthread_t               *threads;
+    //read-mostly
+    TPOOL_CACHE_ALIGNED int tcount;
+    struct _tpool_worker_s  *workers;
     int                     status;
-    int                     exit_flag;
+    atomic_int              exit_flag;
+    atomic_int              paused;
+    int                     shutdown_mode;
+    long                    shutdown_deadline;
+    atomic_int              wait_count;
+    int                     extra_max;
+    size_t                  stack_size;
+    size_t                  guard_size;
+    void                    *stack_mem;
+    size_t                  stack_mem_size;
+    long                    spin_max_ns;
+    int                     flags;
+    int                     sched_policy;
+    int                     sched_priority;
+    int                     nice;
+    atomic_int              timing;
+    struct _tpool_lat_s     *lat_shared;
+    atomic_int              profiling;
+    struct _tpool_prof_s    *prof_shared;
+    struct _tpool_trace_ring_s *trace;
+    int                     trace_count;
+    long                    watchdog_ns;
+    void                    (*watchdog_fn) (tpool_t *tpool, const tpool_stuck_job_t *job, void *arg);
+    void                    *watchdog_arg;
+
+    //written by the producers
+    TPOOL_CACHE_ALIGNED atomic_ulong submitted;
+    atomic_ulong            rejected;
+    atomic_ulong            trace_seq;
+
+    //written by the consumers
+    TPOOL_CACHE_ALIGNED atomic_ulong completed;
+    atomic_ulong            dropped;
+    atomic_int              running;
+
+    //the idle workers, written when a worker goes idle and when a producer wakes one up
+    TPOOL_CACHE_ALIGNED atomic_int spinning;
+    atomic_int              timer;
+    atomic_int              parked;
+    pthread_mutex_t         park_lock;
+    struct _tpool_worker_s  *park_top;
+
+    //written by both, the queue keeps its members on separate lines
+    struct _tpool_q_s       queue;
+
+    //cold, only used by the waits and the blocking regions
+    TPOOL_CACHE_ALIGNED pthread_mutex_t wait_lock;
+    pthread_cond_t          wait_cond;
+    atomic_int              blocking;
+    atomic_int              extra_count;
+    struct _tpool_wstats_s  extra_stats;
+    pthread_t               monitor;
+    pthread_mutex_t         monitor_lock;
+    pthread_cond_t          monitor_cond;
+    int                     monitor_stop;
+    int                     monitor_on;
+    struct _tpool_shm_seg_s *shm;
+    size_t                  shm_size;
+    char                    *shm_name;
+    long                    shm_interval_ns;
+    char                    name[TPOOL_NAME_MAX];
+};
+/**
+ * @brief           The struct that is typedef'd to tpool_group_t
+ * @var tpool       The tpool that the jobs of this group are added to
+ * @var pending     The number of jobs of this group that have not yet completed
+ * 
+ */
+struct _tpool_group_s {
+    tpool_t                 *tpool;
+    atomic_int              pending;
+};
+/************************************************************************************/
+//the upper bounds (le) of the buckets of the latency histograms in the metrics, in ns
+static const long _tpool_metrics_le[] = {
+    1000L, 2500L, 5000L, 10000L, 25000L, 50000L, 100000L, 250000L, 500000L,
+    1000000L, 2500000L, 5000000L, 10000000L, 25000000L, 50000000L, 100000000L, 250000000L, 500000000L,
+    1000000000L, 2500000000L, 5000000000L, 10000000000L
 };
 /************************************************************************************/
+//the tpool whose job is currently being run by this thread, NULL if none
+static __thread tpool_t *_tpool_cur = NULL;
+//the regular worker that is this thread, NULL if none
+static __thread struct _tpool_worker_s *_tpool_self = NULL;
+//the thread id of this thread, 0 until _tpool_gettid is called
+static __thread int _tpool_tid = 0;
+/************************************************************************************/
 //static helper function declarations
 static void *_tpool_thread (void *arg);
+static void *_tpool_extra_thread (void *arg);
+static int _tpool_worker_idle (struct _tpool_worker_s *worker, long deadline);
+static int _tpool_worker_wait (struct _tpool_worker_s *worker, long deadline);
+static void _tpool_stats_init (struct _tpool_wstats_s *stats);
+static void _tpool_stats_read (struct _tpool_wstats_s *stats, int busy, tpool_stats_t *out);
+static int _tpool_park (struct _tpool_worker_s *worker, long deadline);
+static int _tpool_park_timer (struct _tpool_worker_s *worker, long deadline);
+static int _tpool_unpark (struct _tpool_worker_s *worker);
+static void _tpool_wake (tpool_t *tpool);
+static void _tpool_wake_all (tpool_t *tpool);
+static void _tpool_wake_n (tpool_t *tpool, long n);
+static struct _tpool_job_s* _tpool_start_job (tpool_t *tpool);
+static void _tpool_end_job (tpool_t *tpool);
+static int _tpool_poll (tpool_t *tpool, long deadline);
+static void _tpool_spin_update (struct _tpool_worker_s *worker, long gap, int spun, int hit);
+static long _tpool_now_ns (void);
+static long _tpool_coarse_us (void);
+static long _tpool_cpu_ns (void);
+static int _tpool_stacks_alloc (tpool_t *tpool, int count, int mode);
+static int _tpool_thread_attr (tpool_t *tpool, int idx, int sched, pthread_attr_t *attr);
+static int _tpool_thread_create (tpool_t *tpool, int idx, pthread_t *thread, void *(*fn)(void*), void *arg);
+static void _tpool_thread_init (tpool_t *tpool);
+static int _tpool_extra_retire (tpool_t *tpool, struct _tpool_worker_s *worker);
+static void _tpool_extra_fold (tpool_t *tpool, struct _tpool_worker_s *worker);
+static void _tpool_lat_init (struct _tpool_lat_s *lat);
+static int _tpool_hist_index (long ns);
+static void _tpool_hist_add (struct _tpool_hist_s *hist, long ns, int shared);
+static void _tpool_hist_read (struct _tpool_hist_s *hist, tpool_hist_t *out);
+static int _tpool_gettid (void);
+static void _tpool_prof_init (struct _tpool_prof_s *prof);
+static void _tpool_prof_add (struct _tpool_prof_s *prof, void (*fn)(void*), long wall_ns, long cpu_ns, int shared);
+static int _tpool_prof_merge (struct _tpool_prof_s *prof, tpool_prof_entry_t *entries, int count, int max);
+static int _tpool_prof_cmp (const void *a, const void *b);
+static void _tpool_trace_init (tpool_t *tpool, struct _tpool_trace_ring_s *rings, int count, long events);
+static void _tpool_fn_name (void (*fn)(void*), char *buf, size_t size);
+static int _tpool_monitor_start (tpool_t *tpool);
+static void _tpool_monitor_stop (tpool_t *tpool);
+static void *_tpool_monitor_thread (void *arg);
+static void _tpool_watchdog_check (tpool_t *tpool, long threshold_us);
+static int _tpool_shm_create (tpool_t *tpool, const char *name);
+static void _tpool_shm_publish (tpool_t *tpool, int closed);
+static void _tpool_shm_close (tpool_t *tpool);
+static void _tpool_metrics_label (const char *name, char *buf, size_t size);
+static void _tpool_metrics_hist (FILE *fp, const char *metric, const char *help, const char *pool, const tpool_hist_t *hist);
+static void _tpool_trace (tpool_t *tpool, int type, struct _tpool_job_s *job);
+static void _tpool_trace_write (struct _tpool_trace_ring_s *ring, int idx, FILE *fp);
+static int _tpool_add_job (tpool_t *tpool, struct _tpool_group_s *group, void (*job_fn)(void *), void *arg, void (*destructor)(void*), int opt);
+static void _tpool_wait_for (tpool_t *tpool, struct _tpool_group_s *group, int help);
+static int _tpool_is_pending (tpool_t *tpool, struct _tpool_group_s *group);
+static void _tpool_run_job (tpool_t *tpool, struct _tpool_job_s *job, struct _tpool_worker_s *worker);
+static void _tpool_cleanup_job (tpool_t *tpool, struct _tpool_job_s *job, struct _tpool_worker_s *worker);
+static void _tpool_job_done (tpool_t *tpool, struct _tpool_job_s *job);
 static void _tpool_enqueue (struct _tpool_q_s *queue, struct _tpool_job_s *job);
-static struct _tpool_job_s* _tpool_dequeue (struct _tpool_q_s *queue);
+static void _tpool_queue_lock (struct _tpool_q_s *queue, int side);
+static void _tpool_queue_unlock (struct _tpool_q_s *queue, int side);
+static void _tpool_queue_len_add (struct _tpool_q_s *queue, long n);
+static long _tpool_ready_jobs (struct _tpool_q_s *queue);
+static void _tpool_list_push (struct _tpool_job_s **front, struct _tpool_job_s **back, struct _tpool_job_s *job);
+static struct _tpool_job_s* _tpool_list_pop (struct _tpool_job_s **front, struct _tpool_job_s **back);
+static void _tpool_class_refill (struct _tpool_class_s *cls, long now);
+static void _tpool_class_block (struct _tpool_q_s *queue, int class_id, long now);
+static void _tpool_class_unblock (struct _tpool_q_s *queue, int class_id);
+static void _tpool_class_release (struct _tpool_q_s *queue, long now, int all);
+static struct _tpool_job_s* _tpool_dequeue (struct _tpool_q_s *queue, struct _tpool_job_s **dropped);
+static struct _tpool_job_s* _tpool_pick (struct _tpool_q_s *queue, long *now);
+static int _tpool_codel (struct _tpool_q_s *queue, struct _tpool_job_s *job, long now, int can_drop);
 /************************************************************************************/
 //public function definitions
 /**
@@ -102,55 +764,318 @@ static struct _tpool_job_s* _tpool_dequeue (struct _tpool_q_s *queue);
  */
 tpool_t* tpool_create (int count)
 {
-    tpool_t *ret = malloc (sizeof (*ret));
+    return tpool_create_ex (count, NULL);
+}
+/* <==========================================> */
+/**
+ * @brief           Initialises the given attributes with the defaults used by tpool_create
+ * 
+ * @param attr      The attributes to be initialised
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_attr_init (tpool_attr_t *attr)
+{
+    if(attr == NULL) {
+        return TPOOL_FAILURE;
+    }
+    //same as pthread's defaults
+    attr->stack_size    = 0;
+    attr->guard_size    = sysconf (_SC_PAGESIZE);
+    attr->stack_mode    = TPOOL_STACK_DEFAULT;
+    attr->spin_max_ns   = TPOOL_SPIN_MAX_NS;
+    attr->flags         = TPOOL_ATTR_NO_FLAGS;
+    attr->sched_policy  = TPOOL_SCHED_INHERIT;
+    attr->sched_priority= 0;
+    attr->nice          = 0;
+    attr->shed_target_ns   = 0;
+    attr->shed_interval_ns = TPOOL_SHED_INTERVAL_NS;
+    attr->shed_mode        = TPOOL_SHED_REJECT;
+    attr->trace_events     = 0;
+    attr->watchdog_ns      = 0;
+    attr->watchdog_fn      = NULL;
+    attr->watchdog_arg     = NULL;
+    attr->shm_name         = NULL;
+    attr->shm_interval_ns  = TPOOL_SHM_INTERVAL_NS;
+    attr->name             = NULL;
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief           Same as tpool_create, but with the given creation attributes
+ * 
+ * @param count     Specifies the number of worker threads required for this tpool
+ * @param attr      The creation attributes, NULL => defaults
+ * @return tpool_t* Pointer to the tpool - this will be the unique handle for this tpool
+ */
+tpool_t* tpool_create_ex (int count, const tpool_attr_t *attr)
+{
+    tpool_attr_t def_attr;
+    if(attr == NULL) {
+        tpool_attr_init (&def_attr);
+        attr = &def_attr;
+    }
+    if(count <= 0 || (attr->stack_size && attr->stack_size < (size_t)PTHREAD_STACK_MIN) || attr->spin_max_ns < 0 ||
+            attr->stack_mode < TPOOL_STACK_DEFAULT || attr->stack_mode > TPOOL_STACK_HUGEPAGE ||
+            attr->nice < -20 || attr->nice > 19 || attr->shed_target_ns < 0 ||
+            (attr->shed_target_ns && attr->shed_interval_ns <= 0) ||
+            (attr->shed_mode != TPOOL_SHED_REJECT && attr->shed_mode != TPOOL_SHED_DROP) ||
+            attr->trace_events < 0 || attr->trace_events > (1L << 30) || attr->watchdog_ns < 0 ||
+            (attr->shm_name && attr->shm_interval_ns <= 0)) {
+        return NULL;
+    }
+    //the priority has to be valid for the policy, else every pthread_create would fail
+    if(attr->sched_policy != TPOOL_SCHED_INHERIT) {
+        int min = sched_get_priority_min (attr->sched_policy);
+        int max = sched_get_priority_max (attr->sched_policy);
+        if(min == TPOOL_FAILURE || max == TPOOL_FAILURE ||
+                attr->sched_priority < min || attr->sched_priority > max) {
+            return NULL;
+        }
+    }
+
+    tpool_t *ret = aligned_alloc (TPOOL_CACHE_LINE, sizeof (*ret));
     int i;
+    int status;
+    long trace_events;
+    struct _tpool_lat_s *lats;
+    struct _tpool_prof_s *profs;
     //if allocation of the tpool memory was successful
     if(ret) {
         ret->status = TPOOL_FAILURE;
         do {
-            //if sem_init fails, return NULL, leak no memory
-            if(sem_init (&(ret->tpool_sem), 0, 0) == TPOOL_FAILURE) {
-                perror("sem_init");
+            //if mutex_init fails, return NULL, leak no memory
+            if(pthread_mutex_init (&(ret->park_lock), NULL) != 0) {
+                perror("pthread_mutex_init");
                 free(ret);
                 ret = NULL;
                 break;
             }
+            atomic_init (&(ret->spinning), 0);
+            atomic_init (&(ret->timer), TPOOL_FALSE);
+            atomic_init (&(ret->parked), 0);
+            ret->park_top = NULL;
 
             //if mutex_init fails, return NULL, leak no memory
             if(pthread_mutex_init(&(ret->queue.lock), NULL) == TPOOL_FAILURE) {
                 perror("pthread_mutex_init");
-                sem_destroy (&(ret->tpool_sem));
+                pthread_mutex_destroy (&(ret->park_lock));
                 free(ret);
                 ret = NULL;
                 break;
             }
             //init queue pointers
-            ret->queue.front = NULL;
-            ret->queue.back  = NULL;
+            for(i=0; i<TPOOL_MAX_TENANTS; i++) {
+                ret->queue.sub[i].front = NULL;
+                ret->queue.sub[i].back  = NULL;
+                atomic_init (&(ret->queue.sub[i].weight), TPOOL_TENANT_WEIGHT_DEFAULT);
+                atomic_init (&(ret->queue.sub[i].vtime), 0);
+                atomic_init (&(ret->queue.sub[i].cost_ns), TPOOL_COST_INIT_NS);
+            }
+            memset (ret->queue.cls, 0, sizeof(ret->queue.cls));
+            ret->queue.active = 0;
+            ret->queue.vclock = 0;
+            ret->queue.ready = 0;
+            ret->queue.blocked = 0;
+            ret->queue.unlimited = TPOOL_FALSE;
+            ret->queue.shed_target = attr->shed_target_ns;
+            ret->queue.shed_interval = attr->shed_interval_ns;
+            ret->queue.shed_mode = attr->shed_mode;
+            atomic_init (&(ret->queue.overloaded), TPOOL_FALSE);
+            ret->queue.first_above = 0;
+            ret->queue.lock_stats = ((attr->flags & TPOOL_ATTR_LOCK_STATS) != 0);
+            ret->queue.locked_ns = 0;
+            for(i=0; i<2; i++) {
+                atomic_init (&(ret->queue.lockstat[i].acquired), 0);
+                atomic_init (&(ret->queue.lockstat[i].contended), 0);
+                atomic_init (&(ret->queue.lockstat[i].wait_ns), 0);
+                atomic_init (&(ret->queue.lockstat[i].hold_ns), 0);
+            }
+            atomic_init (&(ret->queue.len), 0);
+            atomic_init (&(ret->queue.len_max), 0);
+            atomic_init (&(ret->queue.len_area), 0);
+            atomic_init (&(ret->queue.len_last_us), _tpool_coarse_us ());
+            atomic_init (&(ret->queue.len_since_us), atomic_load (&(ret->queue.len_last_us)));
+            atomic_init (&(ret->queue.fair), TPOOL_FALSE);
+            atomic_init (&(ret->queue.held), 0);
+            atomic_init (&(ret->queue.refill_ns), 0);
+            atomic_init (&(ret->queue.unblocked), TPOOL_FALSE);
+
+            //init the sync variables used by the waits
+            if(pthread_mutex_init (&(ret->wait_lock), NULL) != 0) {
+                perror("pthread_mutex_init");
+                pthread_mutex_destroy (&(ret->queue.lock));
+                pthread_mutex_destroy (&(ret->park_lock));
+                free(ret);
+                ret = NULL;
+                break;
+            }
+            if(pthread_cond_init (&(ret->wait_cond), NULL) != 0) {
+                perror("pthread_cond_init");
+                pthread_mutex_destroy (&(ret->wait_lock));
+                pthread_mutex_destroy (&(ret->queue.lock));
+                pthread_mutex_destroy (&(ret->park_lock));
+                free(ret);
+                ret = NULL;
+                break;
+            }
+            atomic_init (&(ret->submitted), 0);
+            atomic_init (&(ret->completed), 0);
+            atomic_init (&(ret->rejected), 0);
+            atomic_init (&(ret->trace_seq), 0);
+            atomic_init (&(ret->dropped), 0);
+            _tpool_stats_init (&(ret->extra_stats));
+            atomic_init (&(ret->wait_count), 0);
+            atomic_init (&(ret->blocking), 0);
+            atomic_init (&(ret->extra_count), 0);
+            ret->extra_max = count;
+            ret->stack_size = attr->stack_size;
+            ret->guard_size = attr->guard_size;
+            ret->stack_mem = NULL;
+            ret->stack_mem_size = 0;
+            ret->spin_max_ns = attr->spin_max_ns;
+            ret->flags = attr->flags;
+            ret->sched_policy = attr->sched_policy;
+            ret->sched_priority = attr->sched_priority;
+            ret->nice = attr->nice;
+            ret->watchdog_ns = attr->watchdog_ns;
+            ret->watchdog_fn = attr->watchdog_fn;
+            ret->watchdog_arg = attr->watchdog_arg;
+            ret->monitor_on = TPOOL_FALSE;
+            ret->shm = NULL;
+            ret->shm_size = 0;
+            ret->shm_name = NULL;
+            ret->shm_interval_ns = attr->shm_interval_ns;
+            snprintf (ret->name, sizeof(ret->name), "%s", (attr->name) ? attr->name : TPOOL_NAME_DEFAULT);
 
-            //allocate threads array
-            ret->threads = malloc (count * sizeof(*(ret->threads)) );
-            if(ret->threads == NULL) {
-                perror("malloc");
+            //allocate the workers array, cache line aligned since each worker writes its own entry.
+            //The latency histograms of the workers, and the shared ones, follow it, then the
+            //profiler tables, the trace rings and their events
+            trace_events = 0;
+            if(attr->trace_events > 0) {
+                trace_events = TPOOL_TRACE_MIN_EVENTS;
+                while(trace_events < attr->trace_events) {
+                    trace_events <<= 1;
+                }
+            }
+            ret->workers = aligned_alloc (TPOOL_CACHE_LINE, count * sizeof(*(ret->workers)) +
+                                          (count + 1) * sizeof(struct _tpool_lat_s) +
+                                          (count + 1) * sizeof(struct _tpool_prof_s) +
+                                          ((trace_events > 0) ? (count + 1) * (sizeof(struct _tpool_trace_ring_s) +
+                                          trace_events * sizeof(struct _tpool_trace_ev_s)) : 0));
+            if(ret->workers == NULL) {
+                perror("aligned_alloc");
+                pthread_cond_destroy (&(ret->wait_cond));
+                pthread_mutex_destroy (&(ret->wait_lock));
+                pthread_mutex_destroy (&(ret->queue.lock));
+                pthread_mutex_destroy (&(ret->park_lock));
+                free(ret);
+                ret = NULL;
+                break;
+            }
+            //map the region for the worker stacks, if requested for
+            if(attr->stack_mode != TPOOL_STACK_DEFAULT &&
+                    _tpool_stacks_alloc (ret, count, attr->stack_mode) == TPOOL_FAILURE) {
+                free(ret->workers);
+                pthread_cond_destroy (&(ret->wait_cond));
+                pthread_mutex_destroy (&(ret->wait_lock));
                 pthread_mutex_destroy (&(ret->queue.lock));
-                sem_destroy (&(ret->tpool_sem));
+                pthread_mutex_destroy (&(ret->park_lock));
                 free(ret);
                 ret = NULL;
                 break;
             }
+            lats = (struct _tpool_lat_s*)(ret->workers + count);
+            profs = (struct _tpool_prof_s*)(lats + count + 1);
+            ret->lat_shared = &(lats[count]);
+            ret->prof_shared = &(profs[count]);
+            for(i=0; i<=count; i++) {
+                _tpool_lat_init (&(lats[i]));
+                _tpool_prof_init (&(profs[i]));
+            }
+            atomic_init (&(ret->timing), TPOOL_FALSE);
+            atomic_init (&(ret->profiling), TPOOL_FALSE);
+            _tpool_trace_init (ret, (struct _tpool_trace_ring_s*)(profs + count + 1), count, trace_events);
             ret->tcount = count;
+            //the workers read the exit flag as soon as they start
+            atomic_init (&(ret->exit_flag), TPOOL_FALSE);
+            atomic_init (&(ret->paused), TPOOL_FALSE);
+            atomic_init (&(ret->running), 0);
+            ret->shutdown_mode = TPOOL_SHUTDOWN_JOB_OPT;
+            ret->shutdown_deadline = 0;
 
-            //create threads
+            //create threads. If that fails midway, carry on with the ones that were created
             for(i=0; i<count; i++) {
-                pthread_create (&(ret->threads[i]), NULL, _tpool_thread, ret);
+                struct _tpool_worker_s *worker = &(ret->workers[i]);
+                worker->tpool = ret;
+                //start without spinning, the budget grows once jobs arrive quickly enough
+                atomic_init (&(worker->spin_budget_ns), 0);
+                worker->gap_ns = ret->spin_max_ns;
+                worker->hit_ratio = TPOOL_HIT_ONE;
+                atomic_init (&(worker->spin_hits), 0);
+                atomic_init (&(worker->spin_misses), 0);
+                atomic_init (&(worker->state), TPOOL_WORKER_RUNNING);
+                worker->parked = TPOOL_FALSE;
+                worker->park_next = NULL;
+                worker->park_prev = NULL;
+                worker->woken = TPOOL_FALSE;
+                worker->extra = TPOOL_FALSE;
+                worker->lat = &(lats[i]);
+                worker->prof = &(profs[i]);
+                worker->trace = (ret->trace) ? &(ret->trace[i]) : NULL;
+                atomic_init (&(worker->tid), 0);
+                atomic_init (&(worker->job_start_us), 0);
+                atomic_init (&(worker->job_fn), 0);
+                atomic_init (&(worker->job_arg), 0);
+                worker->job_seen = 0;
+                _tpool_stats_init (&(worker->stats));
+
+                if(sem_init (&(worker->park_sem), 0, 0) == TPOOL_FAILURE) {
+                    perror("sem_init");
+                    ret->tcount = i;
+                    break;
+                }
+                status = _tpool_thread_create (ret, i, &(worker->thread), _tpool_thread, worker);
+                if(status != 0) {
+                    errno = status;
+                    perror("pthread_create");
+                    sem_destroy (&(worker->park_sem));
+                    ret->tcount = i;
+                    break;
+                }
+            }
+            //no point in a tpool without workers
+            if(ret->tcount == 0) {
+                if(ret->stack_mem) {
+                    munmap (ret->stack_mem, ret->stack_mem_size);
+                }
+                free(ret->workers);
+                pthread_cond_destroy (&(ret->wait_cond));
+                pthread_mutex_destroy (&(ret->wait_lock));
+                pthread_mutex_destroy (&(ret->queue.lock));
+                pthread_mutex_destroy (&(ret->park_lock));
+                free(ret);
+                ret = NULL;
+                break;
+            }
+            //the tpool works without its watchdog and stats segment, the workers just publish
+            //their jobs for nothing
+            if(attr->shm_name) {
+                _tpool_shm_create (ret, attr->shm_name);
+            }
+            if(ret->watchdog_ns > 0 || ret->shm) {
+                if(_tpool_monitor_start (ret) == TPOOL_SUCCESS) {
+                    ret->monitor_on = TPOOL_TRUE;
+                }
+                else if(ret->shm) {
+                    _tpool_shm_close (ret);
+                }
             }
 
             ret->status = TPOOL_SUCCESS;
-            ret->exit_flag  = TPOOL_FALSE;
         }while(0);  //do while(0) trick to avoid goto statement
     }
     else {
-        perror("malloc");
+        perror("aligned_alloc");
     }
 
     return ret;
@@ -160,7 +1085,8 @@ tpool_t* tpool_create (int count)
  * @brief               Adds the given job to the thread pool. Will fail if 
  *                          tpool is not properly initialised
  *                          job_fn is NULL
- *                          memory allocation fails * 
+ *                          memory allocation fails
+ *                          the job is TPOOL_SHEDDABLE and the tpool sheds jobs (errno EBUSY) * 
  * @param tpool         The handle to the tpool
  * @param job_fn        The function pointer for the job to be performed
  * @param arg           The (optional) arg for job_fn
@@ -170,214 +1096,3419 @@ tpool_t* tpool_create (int count)
  */
 int tpool_add_job (tpool_t *tpool, void (*job_fn)(void *), void *arg, void (*destructor)(void*), int opt)
 {
-    int ret = TPOOL_FAILURE;
-    if(tpool && job_fn && tpool->status == TPOOL_SUCCESS) {
-        struct _tpool_job_s *job = malloc (sizeof(*job));
-        if(job) {
-            //prepare the job struct
-            job->fn_ptr     = job_fn;
-            job->arg        = arg;
-            job->destructor = destructor;
-            job->opt        = opt;
-
-            job->next       = NULL;
-            job->prev       = NULL;
-
-            //add job and notify the workers
-            _tpool_enqueue(&tpool->queue, job);
-            sem_post (&(tpool->tpool_sem));
-            ret = TPOOL_SUCCESS;
-        }
-        else {
-            perror("malloc");
-        }
-    }
-    return ret;
+    return _tpool_add_job (tpool, NULL, job_fn, arg, destructor, opt);
 }
 /* <==========================================> */
 /**
- * @brief           Destroys the given thread pool and its associated sync variables. Can fail if
- *                      ->tpool is NULL or *tpool is NULL
- *                      ->any cleanup fails
- *                  The destructor for a job will be run regardless of options since the thread pool is being 
- *                      forcibly destroyed
+ * @brief           Waits until the thread pool is idle, i.e. every job that has been added has
+ *                      completed. With TPOOL_WAIT_HELP, the calling thread runs queued jobs while
+ *                      it waits. Will fail if
+ *                          tpool is not properly initialised
+ *                          it is called from a job of the same tpool, since it would wait for itself
  * 
- * @param tpool     The thread pool to be destroyed. takes tpool_t** because the tpool_t* will also be freed at the end
- * @return int      Returns 0 on Success, -1 on failure
+ * @param tpool     The handle to the tpool
+ * @param opt       The options for the wait (TPOOL_WAIT_NO_OPT or TPOOL_WAIT_HELP)
+ * @return int      Returns 0 on success, -1 on failure
  */
-int tpool_destroy(tpool_t **tpool)
+int tpool_wait (tpool_t *tpool, int opt)
 {
-    if(tpool == NULL || *tpool == NULL) {
+    if(tpool == NULL || tpool->status != TPOOL_SUCCESS || _tpool_cur == tpool) {
         return TPOOL_FAILURE;
     }
-    //set exit flag and notify threads
-    (*tpool)->exit_flag = TPOOL_TRUE;
-    int i;
-    //post the sem tcount times so that all threads wake up
-    for(i=0; i<(*tpool)->tcount; i++) {
-        sem_post (&((*tpool)->tpool_sem));
-    }
-
-    //join all threads
-    int ret = TPOOL_SUCCESS;
-    for(i=0; i<(*tpool)->tcount; i++) {
-        pthread_join (((*tpool)->threads[i]), NULL);
+    _tpool_wait_for (tpool, NULL, (opt & TPOOL_WAIT_HELP));
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief           Creates a job group on the given thread pool
+ * 
+ * @param tpool     The handle to the tpool
+ * @return tpool_group_t* Pointer to the group, NULL on failure
+ */
+tpool_group_t* tpool_group_create (tpool_t *tpool)
+{
+    if(tpool == NULL || tpool->status != TPOOL_SUCCESS) {
+        return NULL;
     }
-    //free the threads list
-    free((*tpool)->threads);
-    (*tpool)->tcount = 0;(*tpool)->exit_flag = TPOOL_FALSE; 
-
-    //destroy semaphore
-    if(sem_destroy (&((*tpool)->tpool_sem)) == TPOOL_FAILURE) {
-        perror("sem_destroy");
-        ret = TPOOL_FAILURE;
+    tpool_group_t *ret = malloc (sizeof (*ret));
+    if(ret) {
+        ret->tpool = tpool;
+        atomic_init (&(ret->pending), 0);
     }
-
-    //empty the queue
-    struct _tpool_job_s *job;
-    do {
-        job = _tpool_dequeue(&(*tpool)->queue);
-        if(job) {
-            //perform the job if requested for
-            if(job->opt & TPOOL_CLEANUP_RUN_JOB) {
-                (job->fn_ptr) (job->arg);
-            }
-            //cleanup if requested for
-            if(job->arg && job->destructor && (job->opt & TPOOL_RUN_DESTRUCTOR_AFTER_JOB) ) {
-                (job->destructor) (job->arg);
-            }
-            free(job);
-        }
-    }while(job);
-
-    //destroy queue mutex
-    if(pthread_mutex_destroy (&((*tpool)->queue.lock)) == TPOOL_FAILURE) {
-        perror("pthread_mutex_destroy");
-        ret = TPOOL_FAILURE;
+    else {
+        perror("malloc");
     }
-
-    free(*tpool);
-    *tpool = NULL;
-
     return ret;
 }
-/************************************************************************************/
-/** @brief The thread function for the thread pool worker
+/* <==========================================> */
+/**
+ * @brief               Adds the given job to the thread pool of the group, as a member of the group.
+ *                          Fails under the same conditions as tpool_add_job
  * 
- * @param *arg  Pointer to the thread pool struct, since some of its sync variables are required
- * @return void* always returns NULL
+ * @param group         The handle to the group
+ * @param job_fn        The function pointer for the job to be performed
+ * @param arg           The (optional) arg for job_fn
+ * @param destructor    The (optional) destructor for arg
+ * @param opt           The options for job to be performed
+ * @return int          Returns 0 on success, -1 on failure
  */
-static void *_tpool_thread (void *arg)
+int tpool_group_add_job (tpool_group_t *group, void (*job_fn)(void *), void *arg, void (*destructor)(void*), int opt)
 {
-    tpool_t *tpool = arg;
-    int status;
-    struct _tpool_job_s *job;
-    while(1) {
-        //wait for job
-        status = sem_wait (&(tpool->tpool_sem));
-        if(status == TPOOL_FAILURE) {
-            perror("sem_wait");
-            break;
-        }
-
-        //if exit_flag is set, break out of the loop
-        if(tpool->exit_flag == TPOOL_TRUE) {
-            break;
-        }
-
-        //get and process job
-        job = _tpool_dequeue(&(tpool->queue));
-        if(job) {
-            (job->fn_ptr(job->arg));
-            //if destructor calling is requested for, do it
-            if( (job->opt & TPOOL_RUN_DESTRUCTOR_AFTER_JOB) && job->destructor && job->arg ) {
-                job->destructor(job->arg);
-            }
-            //free the job
-            free(job);
-        }
+    if(group == NULL) {
+        return TPOOL_FAILURE;
     }
-    return NULL;
+    return _tpool_add_job (group->tpool, group, job_fn, arg, destructor, opt);
 }
 /* <==========================================> */
 /**
- * @brief       Adds a job to the given queue, thread safe
+ * @brief           Waits until every job of the group has completed. A job of the same tpool that
+ *                      calls this runs queued jobs while it waits, so that nested waits cannot use
+ *                      up all the workers. Other threads do so only with TPOOL_WAIT_HELP. Will fail if
+ *                          group is NULL or its tpool is not properly initialised
  * 
- * @param queue queue to which the job needs to be added
- * @param job   the prepared job structure
+ * @param group     The handle to the group
+ * @param opt       The options for the wait (TPOOL_WAIT_NO_OPT or TPOOL_WAIT_HELP)
+ * @return int      Returns 0 on success, -1 on failure
  */
-static void _tpool_enqueue (struct _tpool_q_s *queue, struct _tpool_job_s *job)
+int tpool_group_wait (tpool_group_t *group, int opt)
 {
-    //it is assumed that queue and job are not NULL, since checks are performed in the caller
-    //it is assumed that the caller has set the job struct links to NULL.
-    pthread_mutex_lock (&(queue->lock));
-
-    //add jobs through the back
-    if(queue->front == NULL) {
-        //it is a bug if front is pointing to NULL and back is pointing to something
-        assert (queue->back == NULL);
-
-        queue->front = job;
-        queue->back  = job;
+    if(group == NULL || group->tpool == NULL || group->tpool->status != TPOOL_SUCCESS) {
+        return TPOOL_FAILURE;
     }
-    else {
-        //it is a bug if front is pointing to something and back is pointing to NULL
-        assert (queue->back != NULL);
-
-        //add job to the back of the queue, update the links
-        queue->back->next   = job;
-        job->prev           = queue->back;
-        queue->back         = job;
+    tpool_t *tpool = group->tpool;
+    _tpool_wait_for (tpool, group, (_tpool_cur == tpool) || (opt & TPOOL_WAIT_HELP));
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief           Destroys the given group. Fails if the group still has jobs that have not completed
+ * 
+ * @param group     The group to be destroyed. takes tpool_group_t** because the tpool_group_t* will also be freed
+ * @return int      Returns 0 on Success, -1 on failure
+ */
+int tpool_group_destroy (tpool_group_t **group)
+{
+    if(group == NULL || *group == NULL || atomic_load (&((*group)->pending)) > 0) {
+        return TPOOL_FAILURE;
     }
-    //don't forget to unlock the mutex
-    pthread_mutex_unlock (&(queue->lock));
+    free(*group);
+    *group = NULL;
+    return TPOOL_SUCCESS;
 }
 /* <==========================================> */
 /**
- * @brief       Remove a job from the queue, thread safe
+ * @brief           Sets the weight of a tenant. When several tenants have queued jobs, each one
+ *                      gets a share of the worker time proportional to its weight, no matter how
+ *                      many jobs it adds. Can fail if
+ *                      ->tpool is NULL
+ *                      ->tenant is not in 0 to TPOOL_MAX_TENANTS-1
+ *                      ->weight is not in 1 to TPOOL_TENANT_WEIGHT_MAX
  * 
- * @param tpool the tpool
- * @return      struct _tpool_job_s* pointer to the job, returns NULL if queue is empty
+ * @param tpool     The thread pool
+ * @param tenant    The tenant, as given to TPOOL_OPT_TENANT
+ * @param weight    The weight of the tenant
+ * @return int      Returns 0 on success, -1 on failure
  */
-static struct _tpool_job_s* _tpool_dequeue (struct _tpool_q_s *queue)
+int tpool_set_tenant_weight (tpool_t *tpool, int tenant, int weight)
 {
-    //assumes that queue is not NULL and initialised fully, since checks are performed in the caller
-    struct _tpool_job_s *ret = NULL;
-
-    //mutex lock the queue
-    pthread_mutex_lock (&(queue->lock));
-
-    //check if list is empty
-    if(queue->front) {
-        //if front is pointing to something, the back should not point to NULL
-        assert (queue->back != NULL);
-
-        //remove node from the front
-        ret = queue->front;
-
-        //update the links
-        //if there is only 1 job in the queue, set the queue pointers to NULL
-        if(queue->front == queue->back) {
-           queue->front  = NULL;
-           queue->back   = NULL;
-        }
-        //else move the front pointer one step back
-        else {
-            queue->front        = queue->front->next;
-            //update links
-            queue->front->prev  = NULL;
-        }
-
-        //clean up return variable so that links aren't exposed to the caller
-        ret->prev                   = NULL;
-        ret->next                   = NULL;
+    if(tpool == NULL || tenant < 0 || tenant >= TPOOL_MAX_TENANTS ||
+            weight < 1 || weight > TPOOL_TENANT_WEIGHT_MAX) {
+        return TPOOL_FAILURE;
     }
-    else {
-        //if front is pointing to NULL, back must also be pointing to NULL
-        assert (queue->back == NULL);
+    pthread_mutex_lock (&(tpool->queue.lock));
+    atomic_store_explicit (&(tpool->queue.sub[tenant].weight), weight, memory_order_relaxed);
+    atomic_store_explicit (&(tpool->queue.fair), TPOOL_TRUE, memory_order_relaxed);
+    pthread_mutex_unlock (&(tpool->queue.lock));
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief           Limits how many jobs of a class are started per second, with a token bucket of
+ *                      burst tokens that refills at rate tokens per second. Every job takes a
+ *                      token when it is started. While a class is out of tokens, its jobs stay
+ *                      queued without holding up a worker, the jobs of other classes keep flowing,
+ *                      and a worker is woken up at the next refill. The bucket starts full. The
+ *                      limits are lifted when the tpool shuts down. Can fail if
+ *                      ->tpool is NULL
+ *                      ->class is not in 1 to TPOOL_MAX_CLASSES-1
+ *                      ->rate is not in 0 to 1000000000, or burst is less than 1
+ * 
+ * @param tpool     The thread pool
+ * @param class_id  The class, as given to TPOOL_OPT_CLASS
+ * @param rate      The number of jobs per second, 0 => unlimited
+ * @param burst     The size of the bucket, i.e. how many jobs can be started at once
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_set_class_rate (tpool_t *tpool, int class_id, long rate, long burst)
+{
+    if(tpool == NULL || class_id < 1 || class_id >= TPOOL_MAX_CLASSES || rate < 0 ||
+            rate > TPOOL_TOKEN || burst < 1 || burst > LONG_MAX / TPOOL_TOKEN) {
+        return TPOOL_FAILURE;
+    }
+    struct _tpool_class_s *cls = &(tpool->queue.cls[class_id]);
+    long count = 0;
+    pthread_mutex_lock (&(tpool->queue.lock));
+    cls->rate    = rate;
+    cls->burst   = burst * TPOOL_TOKEN;
+    cls->tokens  = cls->burst;
+    cls->last_ns = _tpool_now_ns ();
+    if(tpool->queue.blocked & (1U << class_id)) {
+        _tpool_class_unblock (&(tpool->queue), class_id);
+        count = cls->count;
+    }
+    pthread_mutex_unlock (&(tpool->queue.lock));
+
+    if(count > 0 && (tpool->flags & TPOOL_ATTR_BUSY_POLL) == 0) {
+        _tpool_wake_n (tpool, count);
+    }
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief           Stops the tpool from starting jobs. Jobs can still be added, they stay queued
+ *                      until tpool_resume. The idle workers park, they don't spin or poll. Waits
+ *                      don't help out either, so a wait for queued jobs blocks until tpool_resume.
+ *                      Can fail if
+ *                      ->tpool is NULL
+ *                      ->TPOOL_PAUSE_WAIT is given by a job of the same tpool
+ * 
+ * @param tpool     The thread pool
+ * @param opt       TPOOL_PAUSE_WAIT to return only once the running jobs have completed. Must not
+ *                      be used if running jobs wait for queued ones, else TPOOL_PAUSE_NO_OPT
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_pause (tpool_t *tpool, int opt)
+{
+    if(tpool == NULL || ((opt & TPOOL_PAUSE_WAIT) && _tpool_cur == tpool)) {
+        return TPOOL_FAILURE;
+    }
+    //a worker increments running before it checks paused, so either it sees the flag or this
+    //sees it running
+    atomic_store (&(tpool->paused), TPOOL_TRUE);
+    if(opt & TPOOL_PAUSE_WAIT) {
+        atomic_fetch_add (&(tpool->wait_count), 1);
+        pthread_mutex_lock (&(tpool->wait_lock));
+        while(atomic_load (&(tpool->running)) > 0) {
+            pthread_cond_wait (&(tpool->wait_cond), &(tpool->wait_lock));
+        }
+        pthread_mutex_unlock (&(tpool->wait_lock));
+        atomic_fetch_sub (&(tpool->wait_count), 1);
+    }
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief           Lets a paused tpool start jobs again. Wakes up as many parked workers as there
+ *                      are queued jobs (all of them in busy poll mode). Can fail if tpool is NULL
+ * 
+ * @param tpool     The thread pool
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_resume (tpool_t *tpool)
+{
+    if(tpool == NULL) {
+        return TPOOL_FAILURE;
+    }
+    atomic_store (&(tpool->paused), TPOOL_FALSE);
+    //the polling workers are never woken up by the producers, so they must all be awake
+    if(tpool->flags & TPOOL_ATTR_BUSY_POLL) {
+        _tpool_wake_all (tpool);
+    }
+    else {
+        _tpool_wake_n (tpool, _tpool_ready_jobs (&(tpool->queue)));
+    }
+    //waiters may help out again
+    if(atomic_load (&(tpool->wait_count)) > 0) {
+        pthread_mutex_lock (&(tpool->wait_lock));
+        pthread_cond_broadcast (&(tpool->wait_cond));
+        pthread_mutex_unlock (&(tpool->wait_lock));
+    }
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief           Marks the start of a region in which the calling job blocks, e.g. on fsync, a
+ *                      DNS lookup or flock. While the region is open, the tpool admits an extra
+ *                      worker so that the other queued jobs keep all the cores busy. The extra
+ *                      worker retires once the region ends. Will fail if it is not called from a job
+ * 
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_blocking_begin (void)
+{
+    tpool_t *tpool = _tpool_cur;
+    if(tpool == NULL) {
+        return TPOOL_FAILURE;
+    }
+    int blocking = atomic_fetch_add (&(tpool->blocking), 1) + 1;
+    //no point in compensating if the tpool is being destroyed
+    if(tpool->exit_flag == TPOOL_TRUE) {
+        return TPOOL_SUCCESS;
+    }
+
+    //an extra worker that is still lingering from an earlier region is reused
+    int spawn = TPOOL_FALSE;
+    pthread_mutex_lock (&(tpool->wait_lock));
+    int extra = atomic_load (&(tpool->extra_count));
+    if(extra < blocking && extra < tpool->extra_max) {
+        atomic_store (&(tpool->extra_count), extra + 1);
+        spawn = TPOOL_TRUE;
+    }
+    pthread_mutex_unlock (&(tpool->wait_lock));
+
+    if(spawn) {
+        //extra workers are detached, tpool_destroy waits for extra_count to drop to 0 instead
+        pthread_t thread;
+        int status = _tpool_thread_create (tpool, -1, &thread, _tpool_extra_thread, tpool);
+        if(status != 0) {
+            errno = status;
+            perror("pthread_create");
+            pthread_mutex_lock (&(tpool->wait_lock));
+            atomic_fetch_sub (&(tpool->extra_count), 1);
+            pthread_cond_broadcast (&(tpool->wait_cond));
+            pthread_mutex_unlock (&(tpool->wait_lock));
+        }
+    }
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief           Marks the end of a region started with tpool_blocking_begin. Will fail if it is
+ *                      not called from a job, or if there is no open blocking region
+ * 
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_blocking_end (void)
+{
+    tpool_t *tpool = _tpool_cur;
+    if(tpool == NULL) {
+        return TPOOL_FAILURE;
+    }
+    int blocking = atomic_load (&(tpool->blocking));
+    do {
+        if(blocking <= 0) {
+            return TPOOL_FAILURE;
+        }
+    }while(!atomic_compare_exchange_weak (&(tpool->blocking), &blocking, blocking - 1));
+    //the surplus extra worker notices this after its current job, or when its wait times out
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief           Reads the statistics of a worker thread, without stopping it
+ * 
+ * @param tpool     The handle to the tpool
+ * @param idx       The index of the worker, from 0 to the worker count - 1
+ * @param stats     Filled with the statistics
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_get_worker_stats (tpool_t *tpool, int idx, tpool_worker_stats_t *stats)
+{
+    if(tpool == NULL || stats == NULL || tpool->status != TPOOL_SUCCESS || idx < 0 || idx >= tpool->tcount) {
+        return TPOOL_FAILURE;
+    }
+    struct _tpool_worker_s *worker = &(tpool->workers[idx]);
+    stats->state            = atomic_load_explicit (&(worker->state), memory_order_relaxed);
+    stats->spin_budget_ns   = atomic_load_explicit (&(worker->spin_budget_ns), memory_order_relaxed);
+    stats->spin_hits        = atomic_load_explicit (&(worker->spin_hits), memory_order_relaxed);
+    stats->spin_misses      = atomic_load_explicit (&(worker->spin_misses), memory_order_relaxed);
+
+    tpool_stats_t sum = {0};
+    _tpool_stats_read (&(worker->stats), (stats->state == TPOOL_WORKER_RUNNING), &sum);
+    stats->jobs             = sum.jobs;
+    stats->busy_ns          = sum.busy_ns;
+    stats->idle_ns          = sum.idle_ns;
+    stats->wakeups          = sum.wakeups;
+    stats->empty_wakeups    = sum.empty_wakeups;
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief           Reads the statistics of the tpool, summed over all of its workers. The workers
+ *                      are not stopped for this, so the counters are read one by one. Can fail if
+ *                      ->tpool or stats is NULL
+ * 
+ * @param tpool     The thread pool
+ * @param stats     Filled with the statistics
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_get_stats (tpool_t *tpool, tpool_stats_t *stats)
+{
+    int i;
+    if(tpool == NULL || stats == NULL) {
+        return TPOOL_FAILURE;
+    }
+    memset (stats, 0, sizeof(*stats));
+    for(i=0; i<tpool->tcount; i++) {
+        struct _tpool_worker_s *worker = &(tpool->workers[i]);
+        _tpool_stats_read (&(worker->stats),
+                           (atomic_load_explicit (&(worker->state), memory_order_relaxed) == TPOOL_WORKER_RUNNING), stats);
+    }
+    //the extra workers that are still running are only counted once they retire
+    pthread_mutex_lock (&(tpool->wait_lock));
+    _tpool_stats_read (&(tpool->extra_stats), TPOOL_FALSE, stats);
+    pthread_mutex_unlock (&(tpool->wait_lock));
+
+    stats->completed    = atomic_load (&(tpool->completed));
+    stats->submitted    = atomic_load (&(tpool->submitted));
+    stats->queued       = atomic_load_explicit (&(tpool->queue.len), memory_order_relaxed);
+    stats->rejected     = atomic_load_explicit (&(tpool->rejected), memory_order_relaxed);
+    stats->dropped      = atomic_load_explicit (&(tpool->dropped), memory_order_relaxed);
+    for(i=0; i<2; i++) {
+        struct _tpool_lockstat_s *lockstat = &(tpool->queue.lockstat[i]);
+        tpool_lock_stats_t *out = (i == TPOOL_LOCK_PRODUCER) ? &(stats->lock_producers) : &(stats->lock_consumers);
+        out->acquired   = atomic_load_explicit (&(lockstat->acquired), memory_order_relaxed);
+        out->contended  = atomic_load_explicit (&(lockstat->contended), memory_order_relaxed);
+        out->wait_ns    = atomic_load_explicit (&(lockstat->wait_ns), memory_order_relaxed);
+        out->hold_ns    = atomic_load_explicit (&(lockstat->hold_ns), memory_order_relaxed);
+    }
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief           Returns the number of jobs in the queue, i.e. added and not yet started. This is
+ *                      a single atomic load, so it can be polled often
+ * 
+ * @param tpool     The handle to the tpool
+ * @return long     Returns the queue depth, -1 on failure
+ */
+long tpool_queue_depth (tpool_t *tpool)
+{
+    if(tpool == NULL || tpool->status != TPOOL_SUCCESS) {
+        return TPOOL_FAILURE;
+    }
+    return atomic_load_explicit (&(tpool->queue.len), memory_order_relaxed);
+}
+/* <==========================================> */
+/**
+ * @brief           Reads the queue depth, its high-water mark and its time-weighted average since
+ *                      the last reset, without taking the queue lock. The average integrates the
+ *                      depth as a step function over the coarse clock, which is read on every
+ *                      change of the depth, so it is exact to within a coarse clock tick (a few ms)
+ * 
+ * @param tpool     The handle to the tpool
+ * @param stats     Filled with the statistics
+ * @param reset     TPOOL_TRUE (1) to start a new window afterwards: the high-water mark is set to
+ *                      the current depth and the average starts again
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_get_queue_stats (tpool_t *tpool, tpool_queue_stats_t *stats, int reset)
+{
+    struct _tpool_q_s *queue;
+    long now = _tpool_coarse_us ();
+    long len, last, since;
+    unsigned long area;
+    if(tpool == NULL || stats == NULL || tpool->status != TPOOL_SUCCESS) {
+        return TPOOL_FAILURE;
+    }
+    queue = &(tpool->queue);
+    len = atomic_load_explicit (&(queue->len), memory_order_relaxed);
+    last = atomic_load_explicit (&(queue->len_last_us), memory_order_relaxed);
+    since = atomic_load_explicit (&(queue->len_since_us), memory_order_relaxed);
+    area = atomic_load_explicit (&(queue->len_area), memory_order_relaxed);
+    //the length has been held since the last update, as the changes since then were within a tick
+    if(now > last) {
+        area += (unsigned long)len * (now - last);
+    }
+    stats->depth        = len;
+    stats->max_depth    = atomic_load_explicit (&(queue->len_max), memory_order_relaxed);
+    stats->window_ns    = (now > since) ? (now - since) * 1000L : 0;
+    stats->avg_depth    = (now > since) ? (double)area / (now - since) : (double)len;
+
+    //the counters are written with the lock held, so the reset takes it too
+    if(reset) {
+        pthread_mutex_lock (&(queue->lock));
+        now = _tpool_coarse_us ();
+        atomic_store_explicit (&(queue->len_max), atomic_load_explicit (&(queue->len), memory_order_relaxed), memory_order_relaxed);
+        atomic_store_explicit (&(queue->len_area), 0, memory_order_relaxed);
+        atomic_store_explicit (&(queue->len_last_us), now, memory_order_relaxed);
+        atomic_store_explicit (&(queue->len_since_us), now, memory_order_relaxed);
+        pthread_mutex_unlock (&(queue->lock));
+    }
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief           Turns the timestamping of the jobs for the latency histograms on or off. It is
+ *                      off by default, and then the jobs are not timestamped at all. Only the jobs
+ *                      added while it is on are recorded
+ * 
+ * @param tpool     The handle to the tpool
+ * @param enable    TPOOL_TRUE (1) to turn it on, 0 to turn it off
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_set_timing (tpool_t *tpool, int enable)
+{
+    if(tpool == NULL || tpool->status != TPOOL_SUCCESS) {
+        return TPOOL_FAILURE;
+    }
+    atomic_store_explicit (&(tpool->timing), (enable ? TPOOL_TRUE : TPOOL_FALSE), memory_order_relaxed);
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief           Takes a snapshot of the latency histograms of a worker, without stopping it.
+ *                      The buckets are read one by one, so the snapshot may be off by the jobs
+ *                      that complete meanwhile
+ * 
+ * @param tpool     The handle to the tpool
+ * @param idx       The index of the worker, or TPOOL_LATENCY_ALL to merge all of them
+ * @param lat       Filled with the histograms
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_get_latency (tpool_t *tpool, int idx, tpool_latency_t *lat)
+{
+    int i;
+    if(tpool == NULL || lat == NULL || tpool->status != TPOOL_SUCCESS ||
+            idx < TPOOL_LATENCY_ALL || idx >= tpool->tcount) {
+        return TPOOL_FAILURE;
+    }
+    memset (lat, 0, sizeof(*lat));
+    for(i=0; i<tpool->tcount; i++) {
+        if(idx == TPOOL_LATENCY_ALL || idx == i) {
+            _tpool_hist_read (&(tpool->workers[i].lat->wait), &(lat->wait));
+            _tpool_hist_read (&(tpool->workers[i].lat->exec), &(lat->exec));
+        }
+    }
+    if(idx == TPOOL_LATENCY_ALL) {
+        _tpool_hist_read (&(tpool->lat_shared->wait), &(lat->wait));
+        _tpool_hist_read (&(tpool->lat_shared->exec), &(lat->exec));
+    }
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief           Adds the values of the histogram src to dst, e.g. to merge the snapshots of
+ *                      several tpools
+ * 
+ * @param dst       The histogram that is added to
+ * @param src       The histogram to add
+ */
+void tpool_hist_merge (tpool_hist_t *dst, const tpool_hist_t *src)
+{
+    int i;
+    if(dst == NULL || src == NULL) {
+        return;
+    }
+    dst->count  += src->count;
+    dst->sum_ns += src->sum_ns;
+    if(src->max_ns > dst->max_ns) {
+        dst->max_ns = src->max_ns;
+    }
+    for(i=0; i<TPOOL_HIST_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+/* <==========================================> */
+/**
+ * @brief           Returns the given percentile of a histogram, i.e. the upper end of the bucket
+ *                      that holds it (at most max_ns)
+ * 
+ * @param hist      The histogram
+ * @param pct       The percentile, from 0 to 100, e.g. 99.9
+ * @return long     Returns the percentile in ns, -1 if the histogram is empty
+ */
+long tpool_hist_percentile (const tpool_hist_t *hist, double pct)
+{
+    unsigned long rank;
+    unsigned long seen = 0;
+    int i;
+    if(hist == NULL || hist->count == 0 || pct < 0 || pct > 100) {
+        return -1;
+    }
+    //the rank of the value, from 1 to count
+    rank = (unsigned long)((pct / 100.0) * hist->count + 0.5);
+    if(rank == 0) {
+        rank = 1;
+    }
+    for(i=0; i<TPOOL_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if(seen >= rank) {
+            break;
+        }
+    }
+    //the last bucket has no upper end, and the snapshot may have been torn
+    if(i >= TPOOL_HIST_BUCKETS - 1 || tpool_hist_bucket_ns (i + 1) - 1 > (long)hist->max_ns) {
+        return (long)hist->max_ns;
+    }
+    return tpool_hist_bucket_ns (i + 1) - 1;
+}
+/* <==========================================> */
+/**
+ * @brief           Returns the lowest value of a bucket of the histograms
+ * 
+ * @param idx       The index of the bucket, from 0 to TPOOL_HIST_BUCKETS - 1
+ * @return long     Returns the value in ns, -1 if idx is out of range
+ */
+long tpool_hist_bucket_ns (int idx)
+{
+    int shift;
+    if(idx < 0 || idx >= TPOOL_HIST_BUCKETS) {
+        return -1;
+    }
+    if(idx < (1 << TPOOL_HIST_SUB_BITS)) {
+        return idx;
+    }
+    shift = (idx >> TPOOL_HIST_SUB_BITS) - 1;
+    return ((long)(idx & ((1 << TPOOL_HIST_SUB_BITS) - 1)) + (1L << TPOOL_HIST_SUB_BITS)) << shift;
+}
+/* <==========================================> */
+/**
+ * @brief           Turns the profiling of the job functions on or off. It is off by default. While
+ *                      it is on, each worker counts the calls, wall time and CPU time of the jobs
+ *                      it runs, per job function
+ * 
+ * @param tpool     The handle to the tpool
+ * @param enable    TPOOL_TRUE (1) to turn it on, 0 to turn it off
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_set_profiling (tpool_t *tpool, int enable)
+{
+    if(tpool == NULL || tpool->status != TPOOL_SUCCESS) {
+        return TPOOL_FAILURE;
+    }
+    atomic_store_explicit (&(tpool->profiling), (enable ? TPOOL_TRUE : TPOOL_FALSE), memory_order_relaxed);
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief           Reads the profile of the job functions, merged over the workers, sorted by CPU
+ *                      time (highest first)
+ * 
+ * @param tpool     The handle to the tpool
+ * @param entries   Filled with the profile of up to max job functions
+ * @param max       The size of entries
+ * @return int      Returns the number of entries filled, -1 on failure
+ */
+int tpool_get_profile (tpool_t *tpool, tpool_prof_entry_t *entries, int max)
+{
+    tpool_prof_entry_t *all;
+    int size, count = 0;
+    int i;
+    if(tpool == NULL || entries == NULL || max < 0 || tpool->status != TPOOL_SUCCESS) {
+        return TPOOL_FAILURE;
+    }
+    //merge everything first, so that the top max are kept
+    size = (tpool->tcount + 1) * (TPOOL_PROF_SLOTS + 1);
+    all = malloc (size * sizeof(*all));
+    if(all == NULL) {
+        perror("malloc");
+        return TPOOL_FAILURE;
+    }
+    for(i=0; i<tpool->tcount; i++) {
+        count = _tpool_prof_merge (tpool->workers[i].prof, all, count, size);
+    }
+    count = _tpool_prof_merge (tpool->prof_shared, all, count, size);
+    qsort (all, count, sizeof(*all), _tpool_prof_cmp);
+    if(count > max) {
+        count = max;
+    }
+    memcpy (entries, all, count * sizeof(*all));
+    free(all);
+    return count;
+}
+/* <==========================================> */
+/**
+ * @brief           Writes the profile of the job functions as a table, sorted by CPU time. The
+ *                      functions are named with dladdr, so the functions that are not exported
+ *                      are only named if the program is linked with -rdynamic
+ * 
+ * @param tpool     The handle to the tpool
+ * @param fp        The file to write to, e.g. stdout
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_profile_dump (tpool_t *tpool, FILE *fp)
+{
+    tpool_prof_entry_t *entries;
+    char name[256];
+    int count;
+    int i;
+    if(tpool == NULL || fp == NULL || tpool->status != TPOOL_SUCCESS) {
+        return TPOOL_FAILURE;
+    }
+    count = (tpool->tcount + 1) * (TPOOL_PROF_SLOTS + 1);
+    entries = malloc (count * sizeof(*entries));
+    if(entries == NULL) {
+        perror("malloc");
+        return TPOOL_FAILURE;
+    }
+    count = tpool_get_profile (tpool, entries, count);
+
+    fprintf (fp, "%12s %12s %12s %12s %12s  %s\n", "calls", "wall_ms", "avg_us", "max_us", "cpu_ms", "function");
+    for(i=0; i<count; i++) {
+        tpool_prof_entry_t *e = &(entries[i]);
+        fprintf (fp, "%12lu %12.3f %12.3f %12.3f %12.3f  ", e->calls, e->wall_ns / 1e6,
+                 e->wall_ns / 1e3 / e->calls, e->max_ns / 1e3, e->cpu_ns / 1e6);
+        if(e->fn == NULL) {
+            fprintf (fp, "(others)\n");
+        }
+        else {
+            _tpool_fn_name (e->fn, name, sizeof(name));
+            fprintf (fp, "%s\n", name);
+        }
+    }
+    free(entries);
+    return (ferror (fp)) ? TPOOL_FAILURE : TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief           Writes the events recorded by the tracer (tpool_attr_t.trace_events) to a file
+ *                      in the Chrome Trace Event JSON format, which opens in Perfetto or
+ *                      chrome://tracing. Each worker is a thread on the timeline, with its jobs
+ *                      and the times it was parked, and each job is linked to where it was added.
+ *                      The tracer keeps recording meanwhile, and only the latest trace_events
+ *                      events of each worker are kept. Can fail if
+ *                      ->the tpool has no tracer
+ *                      ->the file can't be written (errno set)
+ * 
+ * @param tpool     The handle to the tpool
+ * @param path      The path of the file to write
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_trace_dump (tpool_t *tpool, const char *path)
+{
+    FILE *fp;
+    int i;
+    int ret = TPOOL_SUCCESS;
+    if(tpool == NULL || path == NULL || tpool->status != TPOOL_SUCCESS || tpool->trace == NULL) {
+        return TPOOL_FAILURE;
+    }
+    fp = fopen (path, "w");
+    if(fp == NULL) {
+        perror("fopen");
+        return TPOOL_FAILURE;
+    }
+    fprintf (fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf (fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"tpool %p\"}}",
+             (int)getpid (), (void*)tpool);
+    //the shared ring is the last one
+    for(i=0; i<tpool->trace_count; i++) {
+        _tpool_trace_write (&(tpool->trace[i]), (i < tpool->trace_count - 1) ? i : -1, fp);
+    }
+    fprintf (fp, "\n]}\n");
+    if(ferror (fp)) {
+        ret = TPOOL_FAILURE;
+    }
+    if(fclose (fp) != 0) {
+        perror("fclose");
+        ret = TPOOL_FAILURE;
+    }
+    return ret;
+}
+/* <==========================================> */
+/**
+ * @brief           Writes the metrics of the tpool in the Prometheus text exposition format, e.g.
+ *                      for a /metrics endpoint (open_memstream gives a FILE* that writes to a
+ *                      buffer). The metrics are labelled with the pool name, and the per worker
+ *                      ones with the worker index. They are read from one snapshot of the stats,
+ *                      so the jobs don't do any work for them. The latency histograms are only
+ *                      filled while the timing is on, see tpool_set_timing
+ * 
+ * @param tpool     The handle to the tpool
+ * @param fp        The file to write to
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_metrics_write (tpool_t *tpool, FILE *fp)
+{
+    tpool_stats_t stats;
+    tpool_queue_stats_t queue;
+    tpool_worker_stats_t *workers;
+    tpool_latency_t *lat;
+    char pool[2 * TPOOL_NAME_MAX];
+    int i;
+    if(tpool == NULL || fp == NULL || tpool->status != TPOOL_SUCCESS) {
+        return TPOOL_FAILURE;
+    }
+    //the histograms are too large for the stack of a small thread
+    lat = malloc (sizeof(*lat) + tpool->tcount * sizeof(*workers));
+    if(lat == NULL) {
+        perror("malloc");
+        return TPOOL_FAILURE;
+    }
+    workers = (tpool_worker_stats_t*)(lat + 1);
+
+    //the snapshot
+    tpool_get_stats (tpool, &stats);
+    tpool_get_queue_stats (tpool, &queue, TPOOL_FALSE);
+    tpool_get_latency (tpool, TPOOL_LATENCY_ALL, lat);
+    for(i=0; i<tpool->tcount; i++) {
+        tpool_get_worker_stats (tpool, i, &(workers[i]));
+    }
+    _tpool_metrics_label (tpool->name, pool, sizeof(pool));
+
+    fprintf (fp, "# HELP tpool_jobs_submitted_total Jobs added to the pool.\n# TYPE tpool_jobs_submitted_total counter\n");
+    fprintf (fp, "tpool_jobs_submitted_total{pool=\"%s\"} %lu\n", pool, stats.submitted);
+    fprintf (fp, "# HELP tpool_jobs_completed_total Jobs completed, discarded or shed.\n# TYPE tpool_jobs_completed_total counter\n");
+    fprintf (fp, "tpool_jobs_completed_total{pool=\"%s\"} %lu\n", pool, stats.completed);
+    fprintf (fp, "# HELP tpool_jobs_rejected_total Sheddable jobs turned away by tpool_add_job.\n# TYPE tpool_jobs_rejected_total counter\n");
+    fprintf (fp, "tpool_jobs_rejected_total{pool=\"%s\"} %lu\n", pool, stats.rejected);
+    fprintf (fp, "# HELP tpool_jobs_dropped_total Sheddable jobs dropped from the queue.\n# TYPE tpool_jobs_dropped_total counter\n");
+    fprintf (fp, "tpool_jobs_dropped_total{pool=\"%s\"} %lu\n", pool, stats.dropped);
+    fprintf (fp, "# HELP tpool_queue_depth Jobs in the queue.\n# TYPE tpool_queue_depth gauge\n");
+    fprintf (fp, "tpool_queue_depth{pool=\"%s\"} %ld\n", pool, queue.depth);
+    fprintf (fp, "# HELP tpool_queue_depth_max High-water mark of the queue since the last reset.\n# TYPE tpool_queue_depth_max gauge\n");
+    fprintf (fp, "tpool_queue_depth_max{pool=\"%s\"} %ld\n", pool, queue.max_depth);
+    fprintf (fp, "# HELP tpool_workers Worker threads of the pool.\n# TYPE tpool_workers gauge\n");
+    fprintf (fp, "tpool_workers{pool=\"%s\"} %d\n", pool, tpool->tcount);
+    fprintf (fp, "# HELP tpool_busy_ratio Fraction of the time that the workers were busy, since the pool was created.\n# TYPE tpool_busy_ratio gauge\n");
+    fprintf (fp, "tpool_busy_ratio{pool=\"%s\"} %.6f\n", pool,
+             (stats.busy_ns + stats.idle_ns) ? (double)stats.busy_ns / (stats.busy_ns + stats.idle_ns) : 0.0);
+
+    fprintf (fp, "# HELP tpool_worker_jobs_total Jobs run by the worker.\n# TYPE tpool_worker_jobs_total counter\n");
+    for(i=0; i<tpool->tcount; i++) {
+        fprintf (fp, "tpool_worker_jobs_total{pool=\"%s\",worker=\"%d\"} %lu\n", pool, i, workers[i].jobs);
+    }
+    fprintf (fp, "# HELP tpool_worker_busy_seconds_total Time that the worker spent outside of its idle waits.\n# TYPE tpool_worker_busy_seconds_total counter\n");
+    for(i=0; i<tpool->tcount; i++) {
+        fprintf (fp, "tpool_worker_busy_seconds_total{pool=\"%s\",worker=\"%d\"} %.9f\n", pool, i, workers[i].busy_ns / 1e9);
+    }
+    fprintf (fp, "# HELP tpool_worker_idle_seconds_total Time that the worker spent spinning, parked or polling.\n# TYPE tpool_worker_idle_seconds_total counter\n");
+    for(i=0; i<tpool->tcount; i++) {
+        fprintf (fp, "tpool_worker_idle_seconds_total{pool=\"%s\",worker=\"%d\"} %.9f\n", pool, i, workers[i].idle_ns / 1e9);
+    }
+    fprintf (fp, "# HELP tpool_worker_wakeups_total Times that the worker was woken up after it parked.\n# TYPE tpool_worker_wakeups_total counter\n");
+    for(i=0; i<tpool->tcount; i++) {
+        fprintf (fp, "tpool_worker_wakeups_total{pool=\"%s\",worker=\"%d\"} %lu\n", pool, i, workers[i].wakeups);
+    }
+
+    _tpool_metrics_hist (fp, "tpool_job_wait_seconds", "Time that the jobs spent in the queue.", pool, &(lat->wait));
+    _tpool_metrics_hist (fp, "tpool_job_exec_seconds", "Time that the jobs spent in their job function.", pool, &(lat->exec));
+    free(lat);
+    return (ferror (fp)) ? TPOOL_FAILURE : TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief           Attaches (read only) to the stats segment that a tpool publishes to, see
+ *                      tpool_attr_t.shm_name. Can fail if
+ *                      ->the segment doesn't exist or can't be mapped (errno set)
+ *                      ->the segment is not a tpool stats segment of this version
+ * 
+ * @param name      The name of the segment
+ * @return tpool_shm_t* The handle to the segment, NULL on failure
+ */
+tpool_shm_t* tpool_shm_attach (const char *name)
+{
+    const struct _tpool_shm_seg_s *seg;
+    tpool_shm_t *ret;
+    struct stat st;
+    int fd;
+    if(name == NULL) {
+        return NULL;
+    }
+    fd = shm_open (name, O_RDONLY, 0);
+    if(fd == TPOOL_FAILURE) {
+        return NULL;
+    }
+    if(fstat (fd, &st) == TPOOL_FAILURE || (size_t)st.st_size < sizeof(*seg)) {
+        close (fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    seg = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close (fd);
+    if(seg == MAP_FAILED) {
+        return NULL;
+    }
+    //the segment may still be set up, or be of another layout
+    if(atomic_load_explicit (&(seg->magic), memory_order_acquire) != TPOOL_SHM_MAGIC ||
+            seg->version != TPOOL_SHM_VERSION || seg->snap_size != sizeof(tpool_shm_stats_t) ||
+            seg->worker_size != sizeof(tpool_worker_stats_t) ||
+            (size_t)st.st_size < sizeof(*seg) + seg->tcount * sizeof(tpool_worker_stats_t)) {
+        munmap ((void*)seg, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+    ret = malloc (sizeof(*ret));
+    if(ret == NULL) {
+        perror("malloc");
+        munmap ((void*)seg, st.st_size);
+        return NULL;
+    }
+    ret->seg = seg;
+    ret->size = st.st_size;
+    return ret;
+}
+/* <==========================================> */
+/**
+ * @brief           Reads a consistent snapshot from an attached stats segment. The tpool writes
+ *                      the segment under a seqlock, so this retries while a write is in progress.
+ *                      Can fail if
+ *                      ->the tpool stays in the middle of a write, e.g. it crashed (errno EAGAIN)
+ * 
+ * @param shm       The handle to the segment
+ * @param stats     Filled with the snapshot
+ * @param workers   Filled with the stats of the first max workers, may be NULL if max is 0
+ * @param max       The size of workers
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_shm_read (tpool_shm_t *shm, tpool_shm_stats_t *stats, tpool_worker_stats_t *workers, int max)
+{
+    const struct _tpool_shm_seg_s *seg;
+    unsigned long seq;
+    int i;
+    if(shm == NULL || stats == NULL || max < 0 || (workers == NULL && max > 0)) {
+        return TPOOL_FAILURE;
+    }
+    seg = shm->seg;
+    if(max > seg->tcount) {
+        max = seg->tcount;
+    }
+    for(i=0; i<TPOOL_SHM_RETRIES; i++) {
+        seq = atomic_load_explicit (&(seg->seq), memory_order_acquire);
+        if(seq & 1) {
+            sched_yield ();
+            continue;
+        }
+        memcpy (stats, &(seg->snap), sizeof(*stats));
+        //workers may be NULL when max is 0, and memcpy must not be passed NULL even then
+        if(max > 0) {
+            memcpy (workers, seg->workers, max * sizeof(*workers));
+        }
+        atomic_thread_fence (memory_order_acquire);
+        if(atomic_load_explicit (&(seg->seq), memory_order_relaxed) == seq) {
+            return TPOOL_SUCCESS;
+        }
+    }
+    errno = EAGAIN;
+    return TPOOL_FAILURE;
+}
+/* <==========================================> */
+/**
+ * @brief           Detaches from a stats segment and frees the handle
+ * 
+ * @param shm       The handle to the segment, set to NULL
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_shm_detach (tpool_shm_t **shm)
+{
+    int ret = TPOOL_SUCCESS;
+    if(shm == NULL || *shm == NULL) {
+        return TPOOL_FAILURE;
+    }
+    if(munmap ((void*)(*shm)->seg, (*shm)->size) == TPOOL_FAILURE) {
+        perror("munmap");
+        ret = TPOOL_FAILURE;
+    }
+    free(*shm);
+    *shm = NULL;
+    return ret;
+}
+/* <==========================================> */
+/**
+ * @brief           Starts shutting down the thread pool and returns without waiting. The workers
+ *                      handle the queued jobs as given by mode, in parallel, and then exit.
+ *                      Jobs added by the running jobs are handled the same way. Call tpool_join
+ *                      to wait for the workers and free the tpool, so that the shutdowns of
+ *                      several pools can overlap. Can fail if
+ *                      ->tpool is NULL
+ *                      ->mode is invalid
+ *                      ->the tpool is already shutting down
+ * 
+ * @param tpool     The thread pool
+ * @param mode      One of the TPOOL_SHUTDOWN_* values
+ * @param deadline_ms For TPOOL_SHUTDOWN_DEADLINE, how many ms from now the queued jobs may still
+ *                      be performed for. Ignored for the other modes
+ * @return int      Returns 0 on Success, -1 on failure
+ */
+int tpool_shutdown (tpool_t *tpool, int mode, long deadline_ms)
+{
+    if(tpool == NULL || mode < TPOOL_SHUTDOWN_JOB_OPT || mode > TPOOL_SHUTDOWN_DEADLINE) {
+        return TPOOL_FAILURE;
+    }
+    //the lock makes sure that only one shutdown sets the mode
+    pthread_mutex_lock (&(tpool->wait_lock));
+    if(tpool->exit_flag == TPOOL_TRUE) {
+        pthread_mutex_unlock (&(tpool->wait_lock));
+        return TPOOL_FAILURE;
+    }
+    //lift the rate limits first, so that the workers can drain all the jobs
+    pthread_mutex_lock (&(tpool->queue.lock));
+    tpool->queue.unlimited = TPOOL_TRUE;
+    _tpool_class_release (&(tpool->queue), 0, TPOOL_TRUE);
+    pthread_mutex_unlock (&(tpool->queue.lock));
+
+    //the mode is published by the exit flag, the workers only read it once they see the flag
+    tpool->shutdown_mode = mode;
+    tpool->shutdown_deadline = _tpool_now_ns () + ((deadline_ms > 0) ? deadline_ms * 1000000L : 0);
+
+    //set exit flag and notify threads. The workers that are not parked see the exit flag before
+    //they park. Each worker drains the queue before it exits
+    tpool->exit_flag = TPOOL_TRUE;
+    pthread_mutex_unlock (&(tpool->wait_lock));
+    _tpool_wake_all (tpool);
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief           Waits for the workers of a thread pool that is shutting down to exit, then
+ *                      destroys the thread pool and its associated sync variables. Can fail if
+ *                      ->tpool is NULL or *tpool is NULL
+ *                      ->tpool_shutdown was not called
+ *                      ->any cleanup fails
+ * 
+ * @param tpool     The thread pool to be destroyed. takes tpool_t** because the tpool_t* will also be freed at the end
+ * @return int      Returns 0 on Success, -1 on failure
+ */
+int tpool_join (tpool_t **tpool)
+{
+    if(tpool == NULL || *tpool == NULL || (*tpool)->exit_flag == TPOOL_FALSE) {
+        return TPOOL_FAILURE;
+    }
+    int i;
+
+    //join all threads
+    int ret = TPOOL_SUCCESS;
+    for(i=0; i<(*tpool)->tcount; i++) {
+        pthread_join (((*tpool)->workers[i].thread), NULL);
+        sem_destroy (&((*tpool)->workers[i].park_sem));
+    }
+    //the extra workers are detached, wait for them to exit. This is done after the join since a
+    //job of a regular worker may still spawn one
+    pthread_mutex_lock (&((*tpool)->wait_lock));
+    while(atomic_load (&((*tpool)->extra_count)) > 0) {
+        pthread_cond_wait (&((*tpool)->wait_cond), &((*tpool)->wait_lock));
+    }
+    pthread_mutex_unlock (&((*tpool)->wait_lock));
+    //empty the queue, the workers have drained it unless there were none or a job was
+    //added after they exited. This is done before the workers block is freed, since it also holds
+    //the shared latency, profiler and trace buffers that the jobs record into
+    struct _tpool_job_s *job;
+    do {
+        job = _tpool_dequeue(&(*tpool)->queue, NULL);
+        if(job) {
+            _tpool_cleanup_job (*tpool, job, NULL);
+        }
+    }while(job);
+    //the monitor reads the workers, so it is stopped once they have exited. Until then it keeps
+    //reporting the jobs of the workers that hang the shutdown
+    if((*tpool)->monitor_on == TPOOL_TRUE) {
+        _tpool_monitor_stop (*tpool);
+    }
+    //publish the final stats, and tell the viewers that the tpool is gone
+    if((*tpool)->shm) {
+        _tpool_shm_close (*tpool);
+    }
+    //free the workers list, and the stacks if the tpool mapped them
+    free((*tpool)->workers);
+    if((*tpool)->stack_mem && munmap ((*tpool)->stack_mem, (*tpool)->stack_mem_size) == TPOOL_FAILURE) {
+        perror("munmap");
+        ret = TPOOL_FAILURE;
+    }
+    (*tpool)->tcount = 0;(*tpool)->exit_flag = TPOOL_FALSE; 
+
+    //destroy the park lock
+    if(pthread_mutex_destroy (&((*tpool)->park_lock)) != 0) {
+        perror("pthread_mutex_destroy");
+        ret = TPOOL_FAILURE;
+    }
+
+    //destroy the sync variables used by the waits
+    if(pthread_cond_destroy (&((*tpool)->wait_cond)) != 0) {
+        perror("pthread_cond_destroy");
+        ret = TPOOL_FAILURE;
+    }
+    if(pthread_mutex_destroy (&((*tpool)->wait_lock)) != 0) {
+        perror("pthread_mutex_destroy");
+        ret = TPOOL_FAILURE;
+    }
+
+    //destroy queue mutex
+    if(pthread_mutex_destroy (&((*tpool)->queue.lock)) == TPOOL_FAILURE) {
+        perror("pthread_mutex_destroy");
+        ret = TPOOL_FAILURE;
+    }
+
+    free(*tpool);
+    *tpool = NULL;
+
+    return ret;
+}
+/* <==========================================> */
+/**
+ * @brief           Destroys the given thread pool and its associated sync variables, same as
+ *                      tpool_shutdown with TPOOL_SHUTDOWN_JOB_OPT followed by tpool_join. Can fail if
+ *                      ->tpool is NULL or *tpool is NULL
+ *                      ->any cleanup fails
+ *                  A queued job is performed only if it has TPOOL_CLEANUP_RUN_JOB, and its destructor is run
+ *                      only if it has TPOOL_RUN_DESTRUCTOR_AFTER_JOB
+ *                  The pending jobs are drained by all the workers in parallel before they exit
+ * 
+ * @param tpool     The thread pool to be destroyed. takes tpool_t** because the tpool_t* will also be freed at the end
+ * @return int      Returns 0 on Success, -1 on failure
+ */
+int tpool_destroy(tpool_t **tpool)
+{
+    if(tpool == NULL || *tpool == NULL) {
+        return TPOOL_FAILURE;
+    }
+    //the tpool may already be shutting down in another mode
+    tpool_shutdown (*tpool, TPOOL_SHUTDOWN_JOB_OPT, 0);
+    return tpool_join (tpool);
+}
+/************************************************************************************/
+/** @brief The thread function for the thread pool worker
+ * 
+ * @param *arg  Pointer to the worker struct, which points to the thread pool struct
+ * @return void* always returns NULL
+ */
+static void *_tpool_thread (void *arg)
+{
+    struct _tpool_worker_s *worker = arg;
+    tpool_t *tpool = worker->tpool;
+    int status;
+    struct _tpool_job_s *job;
+    _tpool_thread_init (tpool);
+    _tpool_self = worker;
+    if(worker->trace) {
+        atomic_store_explicit (&(worker->trace->tid), _tpool_gettid (), memory_order_relaxed);
+    }
+    if(tpool->watchdog_ns > 0) {
+        atomic_store_explicit (&(worker->tid), _tpool_gettid (), memory_order_relaxed);
+    }
+    while(1) {
+        //get and process job. Once exit_flag is set, the rest of the queue is cleaned up
+        job = _tpool_start_job (tpool);
+        if(worker->woken == TPOOL_TRUE) {
+            worker->woken = TPOOL_FALSE;
+            if(job == NULL) {
+                TPOOL_STAT_ADD(worker->stats.empty_wakeups, 1);
+            }
+        }
+        if(job) {
+            if(tpool->exit_flag == TPOOL_TRUE) {
+                _tpool_cleanup_job (tpool, job, worker);
+            }
+            else {
+                _tpool_run_job (tpool, job, worker);
+                TPOOL_STAT_ADD(worker->stats.jobs, 1);
+            }
+            _tpool_end_job (tpool);
+            continue;
+        }
+
+        //if exit_flag is set and the queue is drained, break out of the loop
+        if(tpool->exit_flag == TPOOL_TRUE) {
+            break;
+        }
+
+        //wait for job
+        status = _tpool_worker_idle (worker, 0);
+        if(status == TPOOL_FAILURE) {
+            perror("sem_wait");
+            break;
+        }
+    }
+    return NULL;
+}
+/* <==========================================> */
+/**
+ * @brief           Called by a worker that found the queue empty. The worker first spins for its
+ *                      spin budget, in case a job arrives soon, and then parks until a producer
+ *                      wakes it up. Returns once there may be a job, the tpool is being destroyed
+ *                      or the deadline passes
+ * 
+ * @param worker    the worker
+ * @param deadline  the _tpool_now_ns time to give up at, 0 => never
+ * @return int      Returns 0 on success, -1 on failure or timeout (with errno set)
+ */
+static int _tpool_worker_idle (struct _tpool_worker_s *worker, long deadline)
+{
+    //the busy and idle times are only taken when the worker switches between the two
+    long start = _tpool_now_ns ();
+    long since = atomic_load_explicit (&(worker->stats.since_ns), memory_order_relaxed);
+    int status;
+
+    TPOOL_STAT_ADD(worker->stats.busy_ns, start - since);
+    status = _tpool_worker_wait (worker, deadline);
+    since = _tpool_now_ns ();
+    TPOOL_STAT_ADD(worker->stats.idle_ns, since - start);
+    atomic_store_explicit (&(worker->stats.since_ns), since, memory_order_relaxed);
+    return status;
+}
+/* <==========================================> */
+/**
+ * @brief           Initialises the counters of a worker, its busy time starts now
+ * 
+ * @param stats     the counters
+ */
+static void _tpool_stats_init (struct _tpool_wstats_s *stats)
+{
+    atomic_init (&(stats->jobs), 0);
+    atomic_init (&(stats->busy_ns), 0);
+    atomic_init (&(stats->idle_ns), 0);
+    atomic_init (&(stats->wakeups), 0);
+    atomic_init (&(stats->empty_wakeups), 0);
+    atomic_init (&(stats->since_ns), _tpool_now_ns ());
+}
+/* <==========================================> */
+/**
+ * @brief           Adds the counters of a worker to out, without stopping the worker
+ * 
+ * @param stats     the counters
+ * @param busy      TPOOL_TRUE if the worker is busy, its busy time since since_ns is added then
+ * @param out       the sums
+ */
+static void _tpool_stats_read (struct _tpool_wstats_s *stats, int busy, tpool_stats_t *out)
+{
+    long since = atomic_load_explicit (&(stats->since_ns), memory_order_relaxed);
+    long now = _tpool_now_ns ();
+    out->jobs           += atomic_load_explicit (&(stats->jobs), memory_order_relaxed);
+    out->busy_ns        += atomic_load_explicit (&(stats->busy_ns), memory_order_relaxed);
+    out->idle_ns        += atomic_load_explicit (&(stats->idle_ns), memory_order_relaxed);
+    out->wakeups        += atomic_load_explicit (&(stats->wakeups), memory_order_relaxed);
+    out->empty_wakeups  += atomic_load_explicit (&(stats->empty_wakeups), memory_order_relaxed);
+    if(busy && now > since) {
+        out->busy_ns += now - since;
+    }
+}
+/* <==========================================> */
+/**
+ * @brief           Does the waiting for _tpool_worker_idle: spins, then parks
+ * 
+ * @param worker    the worker
+ * @param deadline  the _tpool_now_ns time to give up at, 0 => never
+ * @return int      Returns 0 on success, -1 on failure or timeout (with errno set)
+ */
+static int _tpool_worker_wait (struct _tpool_worker_s *worker, long deadline)
+{
+    tpool_t *tpool = worker->tpool;
+    long budget = atomic_load_explicit (&(worker->spin_budget_ns), memory_order_relaxed);
+    long idle_start, now;
+    int hit = TPOOL_FALSE;
+    int status;
+    int i;
+
+    //a paused tpool doesn't start jobs, so there's nothing to spin for
+    if(tpool->paused == TPOOL_TRUE && tpool->exit_flag == TPOOL_FALSE) {
+        status = _tpool_park (worker, deadline);
+        atomic_store_explicit (&(worker->state), TPOOL_WORKER_RUNNING, memory_order_relaxed);
+        return status;
+    }
+
+    //busy poll mode never parks (unless paused), and the producers never wake anyone up
+    if(tpool->flags & TPOOL_ATTR_BUSY_POLL) {
+        //the polling worker is idle for the stats, same as a spinning one
+        atomic_store_explicit (&(worker->state), TPOOL_WORKER_SPINNING, memory_order_relaxed);
+        status = _tpool_poll (tpool, deadline);
+        atomic_store_explicit (&(worker->state), TPOOL_WORKER_RUNNING, memory_order_relaxed);
+        if(status == TPOOL_FAILURE) {
+            errno = ETIMEDOUT;
+            return TPOOL_FAILURE;
+        }
+        return TPOOL_SUCCESS;
+    }
+
+    idle_start = _tpool_now_ns ();
+    now = idle_start;
+    if(budget > 0) {
+        //producers don't wake anyone up for a job that a spinning worker will take
+        atomic_store_explicit (&(worker->state), TPOOL_WORKER_SPINNING, memory_order_relaxed);
+        atomic_fetch_add (&(tpool->spinning), 1);
+        while(now - idle_start < budget && hit == TPOOL_FALSE) {
+            for(i=0; i<TPOOL_SPIN_POLLS; i++) {
+                if(_tpool_ready_jobs (&(tpool->queue)) > 0) {
+                    hit = TPOOL_TRUE;
+                    break;
+                }
+                TPOOL_CPU_RELAX();
+            }
+            now = _tpool_now_ns ();
+        }
+        atomic_fetch_sub (&(tpool->spinning), 1);
+    }
+
+    if(hit == TPOOL_FALSE) {
+        if(_tpool_park_timer (worker, deadline) == TPOOL_FAILURE) {
+            atomic_store_explicit (&(worker->state), TPOOL_WORKER_RUNNING, memory_order_relaxed);
+            return TPOOL_FAILURE;
+        }
+        now = _tpool_now_ns ();
+    }
+    atomic_store_explicit (&(worker->state), TPOOL_WORKER_RUNNING, memory_order_relaxed);
+    //an extra worker only lingers briefly, so it parks right away instead of learning to spin
+    if(worker->extra == TPOOL_FALSE) {
+        _tpool_spin_update (worker, now - idle_start, (budget > 0), hit);
+    }
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief           Parks the worker on top of the park stack and sleeps until a producer pops it
+ *                      and posts its semaphore. A producer that enqueued a job before it saw this
+ *                      worker in the stack may have skipped the wakeup, so the queue is checked
+ *                      again after the push (the fences pair with the one in _tpool_wake)
+ * 
+ * @param worker    the worker
+ * @param deadline  the _tpool_now_ns time to give up at, 0 => never
+ * @return int      Returns 0 on success, -1 on failure or timeout (with errno set)
+ */
+static int _tpool_park (struct _tpool_worker_s *worker, long deadline)
+{
+    tpool_t *tpool = worker->tpool;
+    struct timespec ts;
+    long left;
+    int status;
+
+    pthread_mutex_lock (&(tpool->park_lock));
+    worker->park_prev = NULL;
+    worker->park_next = tpool->park_top;
+    if(tpool->park_top) {
+        tpool->park_top->park_prev = worker;
+    }
+    tpool->park_top = worker;
+    worker->parked = TPOOL_TRUE;
+    atomic_fetch_add (&(tpool->parked), 1);
+    pthread_mutex_unlock (&(tpool->park_lock));
+    atomic_store_explicit (&(worker->state), TPOOL_WORKER_PARKED, memory_order_relaxed);
+
+    atomic_thread_fence (memory_order_seq_cst);
+    if((_tpool_ready_jobs (&(tpool->queue)) > 0 && tpool->paused == TPOOL_FALSE) ||
+            tpool->exit_flag == TPOOL_TRUE) {
+        //if a producer already popped this worker, its post is on the way, so sleep for it
+        if(_tpool_unpark (worker) == TPOOL_TRUE) {
+            return TPOOL_SUCCESS;
+        }
+        deadline = 0;
+    }
+
+    if(tpool->trace) {
+        _tpool_trace (tpool, TPOOL_TRACE_PARK, NULL);
+    }
+    TPOOL_PROBE3(park, tpool, worker, atomic_load_explicit (&(tpool->queue.len), memory_order_relaxed));
+    if(deadline == 0) {
+        while((status = sem_wait (&(worker->park_sem))) == TPOOL_FAILURE && errno == EINTR) {
+        }
+    }
+    else {
+        //sem_timedwait takes an absolute CLOCK_REALTIME time
+        left = deadline - _tpool_now_ns ();
+        clock_gettime (CLOCK_REALTIME, &ts);
+        ts.tv_sec  += (left > 0) ? left / 1000000000L : 0;
+        ts.tv_nsec += (left > 0) ? left % 1000000000L : 0;
+        if(ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        while((status = sem_timedwait (&(worker->park_sem), &ts)) == TPOOL_FAILURE && errno == EINTR) {
+        }
+        if(status == TPOOL_FAILURE && errno == ETIMEDOUT) {
+            if(_tpool_unpark (worker) == TPOOL_TRUE) {
+                if(tpool->trace) {
+                    _tpool_trace (tpool, TPOOL_TRACE_UNPARK, NULL);
+                }
+                TPOOL_PROBE4(wake, tpool, worker, atomic_load_explicit (&(tpool->queue.len), memory_order_relaxed), status);
+                errno = ETIMEDOUT;
+                return status;
+            }
+            //popped just now, consume the post so that the next park doesn't return early
+            while((status = sem_wait (&(worker->park_sem))) == TPOOL_FAILURE && errno == EINTR) {
+            }
+        }
+    }
+    if(tpool->trace) {
+        _tpool_trace (tpool, TPOOL_TRACE_UNPARK, NULL);
+    }
+    TPOOL_PROBE4(wake, tpool, worker, atomic_load_explicit (&(tpool->queue.len), memory_order_relaxed), status);
+    if(status == TPOOL_SUCCESS) {
+        worker->woken = TPOOL_TRUE;
+        TPOOL_STAT_ADD(worker->stats.wakeups, 1);
+    }
+    return status;
+}
+/* <==========================================> */
+/**
+ * @brief           Parks the worker like _tpool_park. While some jobs are held back by classes
+ *                      that are out of tokens, one of the parked workers is the timer: it parks
+ *                      with the next refill as its deadline, so that it can start the held jobs.
+ *                      If the timer is woken up for something else, it passes the role on
+ * 
+ * @param worker    the worker
+ * @param deadline  the _tpool_now_ns time to give up at, 0 => never
+ * @return int      Returns 0 on success, -1 on failure or timeout (with errno set)
+ */
+static int _tpool_park_timer (struct _tpool_worker_s *worker, long deadline)
+{
+    tpool_t *tpool = worker->tpool;
+    int expected = TPOOL_FALSE;
+    long refill;
+    int status;
+
+    if(atomic_load_explicit (&(tpool->queue.held), memory_order_relaxed) == 0 ||
+            atomic_compare_exchange_strong (&(tpool->timer), &expected, TPOOL_TRUE) == 0) {
+        return _tpool_park (worker, deadline);
+    }
+    refill = atomic_load_explicit (&(tpool->queue.refill_ns), memory_order_relaxed);
+    if(deadline && deadline <= refill) {
+        //the caller's deadline comes first, it's a normal park
+        status = _tpool_park (worker, deadline);
+    }
+    else {
+        status = _tpool_park (worker, refill);
+        if(status == TPOOL_FAILURE && errno == ETIMEDOUT) {
+            status = TPOOL_SUCCESS;
+        }
+    }
+    atomic_store (&(tpool->timer), TPOOL_FALSE);
+
+    //woken up early, let another parked worker take over as the timer
+    if(status == TPOOL_SUCCESS && atomic_load_explicit (&(tpool->queue.held), memory_order_relaxed) > 0 &&
+            _tpool_now_ns () < atomic_load_explicit (&(tpool->queue.refill_ns), memory_order_relaxed)) {
+        _tpool_wake_n (tpool, 1);
+    }
+    return status;
+}
+/* <==========================================> */
+/**
+ * @brief           Takes the worker out of the park stack, if it is still in it
+ * 
+ * @param worker    the worker
+ * @return int      TPOOL_TRUE if the worker was in the stack, TPOOL_FALSE if a producer has
+ *                      already popped it (and posted or is about to post its semaphore)
+ */
+static int _tpool_unpark (struct _tpool_worker_s *worker)
+{
+    tpool_t *tpool = worker->tpool;
+    int ret = TPOOL_FALSE;
+    pthread_mutex_lock (&(tpool->park_lock));
+    if(worker->parked == TPOOL_TRUE) {
+        if(worker->park_prev) {
+            worker->park_prev->park_next = worker->park_next;
+        }
+        else {
+            tpool->park_top = worker->park_next;
+        }
+        if(worker->park_next) {
+            worker->park_next->park_prev = worker->park_prev;
+        }
+        worker->parked = TPOOL_FALSE;
+        atomic_fetch_sub (&(tpool->parked), 1);
+        ret = TPOOL_TRUE;
+    }
+    pthread_mutex_unlock (&(tpool->park_lock));
+    return ret;
+}
+/* <==========================================> */
+/**
+ * @brief           Called after a job is enqueued. Wakes up a parked worker, but only if no awake
+ *                      worker can take the job: the spinning workers take one job each, so a
+ *                      worker is woken up only if there are more queued jobs than spinning workers.
+ *                      The running workers are not counted, since they may stay busy for long.
+ *                      The most recently parked worker is woken up, since its cache is still warm
+ * 
+ * @param tpool     the tpool
+ */
+static void _tpool_wake (tpool_t *tpool)
+{
+    struct _tpool_worker_s *worker = NULL;
+
+    //pairs with the fence in _tpool_park, so either the parking worker sees the job or this sees
+    //the parked worker. tpool_resume wakes up the workers for the jobs added while paused
+    atomic_thread_fence (memory_order_seq_cst);
+    if(atomic_load_explicit (&(tpool->parked), memory_order_relaxed) == 0 ||
+            atomic_load_explicit (&(tpool->paused), memory_order_relaxed) == TPOOL_TRUE ||
+            _tpool_ready_jobs (&(tpool->queue)) <=
+            atomic_load_explicit (&(tpool->spinning), memory_order_relaxed)) {
+        return;
+    }
+
+    pthread_mutex_lock (&(tpool->park_lock));
+    if(tpool->park_top) {
+        worker = tpool->park_top;
+        tpool->park_top = worker->park_next;
+        if(tpool->park_top) {
+            tpool->park_top->park_prev = NULL;
+        }
+        worker->parked = TPOOL_FALSE;
+        atomic_fetch_sub (&(tpool->parked), 1);
+    }
+    pthread_mutex_unlock (&(tpool->park_lock));
+
+    if(worker) {
+        sem_post (&(worker->park_sem));
+    }
+}
+/* <==========================================> */
+/**
+ * @brief           Wakes up the n most recently parked workers (or all of them, if fewer are
+ *                      parked)
+ * 
+ * @param tpool     the tpool
+ * @param n         the number of workers to wake up
+ */
+static void _tpool_wake_n (tpool_t *tpool, long n)
+{
+    struct _tpool_worker_s *worker;
+    pthread_mutex_lock (&(tpool->park_lock));
+    while(tpool->park_top && n > 0) {
+        worker = tpool->park_top;
+        tpool->park_top = worker->park_next;
+        if(tpool->park_top) {
+            tpool->park_top->park_prev = NULL;
+        }
+        worker->parked = TPOOL_FALSE;
+        atomic_fetch_sub (&(tpool->parked), 1);
+        sem_post (&(worker->park_sem));
+        n--;
+    }
+    pthread_mutex_unlock (&(tpool->park_lock));
+}
+/* <==========================================> */
+/**
+ * @brief           Wakes up every parked worker, e.g. when the tpool is being destroyed
+ * 
+ * @param tpool     the tpool
+ */
+static void _tpool_wake_all (tpool_t *tpool)
+{
+    struct _tpool_worker_s *worker;
+    pthread_mutex_lock (&(tpool->park_lock));
+    while(tpool->park_top) {
+        worker = tpool->park_top;
+        tpool->park_top = worker->park_next;
+        worker->parked = TPOOL_FALSE;
+        atomic_fetch_sub (&(tpool->parked), 1);
+        sem_post (&(worker->park_sem));
+    }
+    pthread_mutex_unlock (&(tpool->park_lock));
+}
+/* <==========================================> */
+/**
+ * @brief           Busy polls the queue until it has a job, the tpool is being destroyed or the
+ *                      deadline passes. Backs off exponentially (up to TPOOL_POLL_BACKOFF_MAX
+ *                      pauses) while the queue stays empty. With WAITPKG (-mwaitpkg), umwait on the
+ *                      queue length is used instead of pause, so the core drops into a light sleep
+ *                      and is woken by the write to it
+ * 
+ * @param tpool     the tpool
+ * @param deadline  the _tpool_now_ns time to give up at, 0 => never
+ * @return int      Returns 0 if there is a job, a blocked class is due for a refill or the tpool is
+ *                      being destroyed, -1 on timeout
+ */
+static int _tpool_poll (tpool_t *tpool, long deadline)
+{
+    int backoff = 1;
+    long now;
+    while(_tpool_ready_jobs (&(tpool->queue)) == 0 &&
+            atomic_load_explicit (&(tpool->exit_flag), memory_order_relaxed) == TPOOL_FALSE) {
+#ifdef __WAITPKG__
+        __builtin_ia32_umonitor ((void*)&(tpool->queue.len));
+        if(atomic_load_explicit (&(tpool->queue.len), memory_order_relaxed) == 0) {
+            __builtin_ia32_umwait (0, __builtin_ia32_rdtsc () + TPOOL_UMWAIT_TICKS);
+        }
+#else
+        int i;
+        for(i=0; i<backoff; i++) {
+            TPOOL_CPU_RELAX();
+        }
+#endif
+        if(backoff < TPOOL_POLL_BACKOFF_MAX) {
+            backoff *= 2;
+        }
+        else if(deadline || atomic_load_explicit (&(tpool->queue.held), memory_order_relaxed) > 0) {
+            //a blocked class gets its tokens back without anything being written to the queue
+            now = _tpool_now_ns ();
+            if(deadline && now >= deadline) {
+                return TPOOL_FAILURE;
+            }
+            if(atomic_load_explicit (&(tpool->queue.held), memory_order_relaxed) > 0 &&
+                    now >= atomic_load_explicit (&(tpool->queue.refill_ns), memory_order_relaxed)) {
+                return TPOOL_SUCCESS;
+            }
+        }
+    }
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief           Adapts the spin budget of a worker after it waited for a job. The budget is
+ *                      twice the EWMA of the idle gaps, so that the worker spins through the
+ *                      typical gap, as long as that is below spin_max_ns. It is then scaled down
+ *                      by the EWMA of the spin hit ratio, so a worker whose spins keep missing
+ *                      spins less. The ratio has a floor, so that the budget can recover once the
+ *                      gaps shrink again
+ * 
+ * @param worker    the worker
+ * @param gap       how long the worker was idle before it got the job
+ * @param spun      TPOOL_TRUE if the worker spun
+ * @param hit       TPOOL_TRUE if the job arrived while it was spinning
+ */
+static void _tpool_spin_update (struct _tpool_worker_s *worker, long gap, int spun, int hit)
+{
+    long max = worker->tpool->spin_max_ns;
+    long budget = 0;
+
+    worker->gap_ns += (gap - worker->gap_ns) >> TPOOL_EWMA_SHIFT;
+    if(spun) {
+        worker->hit_ratio += ((hit ? TPOOL_HIT_ONE : 0) - worker->hit_ratio) >> TPOOL_EWMA_SHIFT;
+        if(hit) {
+            atomic_fetch_add_explicit (&(worker->spin_hits), 1, memory_order_relaxed);
+        }
+        else {
+            atomic_fetch_add_explicit (&(worker->spin_misses), 1, memory_order_relaxed);
+        }
+    }
+
+    if(worker->gap_ns < max) {
+        budget = 2 * worker->gap_ns;
+        if(budget > max) {
+            budget = max;
+        }
+        budget = budget * (worker->hit_ratio > TPOOL_HIT_ONE/8 ? worker->hit_ratio : TPOOL_HIT_ONE/8) / TPOOL_HIT_ONE;
+    }
+    atomic_store_explicit (&(worker->spin_budget_ns), budget, memory_order_relaxed);
+}
+/* <==========================================> */
+/**
+ * @brief       Reads the monotonic clock
+ * 
+ * @return long the time in nanoseconds
+ */
+static long _tpool_now_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+/* <==========================================> */
+/**
+ * @brief       Reads the coarse monotonic clock, which is cheaper to read than the monotonic
+ *                  clock but only advances every tick
+ * 
+ * @return long the time in microseconds
+ */
+static long _tpool_coarse_us (void)
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+/* <==========================================> */
+/**
+ * @brief       Reads the CPU time of the calling thread
+ * 
+ * @return long the time in nanoseconds
+ */
+static long _tpool_cpu_ns (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+/* <==========================================> */
+/** @brief The thread function for an extra worker that compensates for an open blocking region.
+ *          Same as _tpool_thread, except that it retires once there are more extra workers than
+ *          open blocking regions
+ * 
+ * @param *arg  Pointer to the thread pool struct, since some of its sync variables are required
+ * @return void* always returns NULL
+ */
+static void *_tpool_extra_thread (void *arg)
+{
+    tpool_t *tpool = arg;
+    int status;
+    struct _tpool_job_s *job;
+    int retired = TPOOL_FALSE;
+    //the extra worker can park like the regular ones, its state lives on its stack. It never spins,
+    //since its budget starts at 0 and is never updated
+    struct _tpool_worker_s worker = { .tpool = tpool, .parked = TPOOL_FALSE, .gap_ns = tpool->spin_max_ns,
+                                      .hit_ratio = TPOOL_HIT_ONE, .woken = TPOOL_FALSE, .extra = TPOOL_TRUE, .lat = NULL,
+                                      .trace = NULL, .prof = NULL };
+    atomic_init (&(worker.state), TPOOL_WORKER_RUNNING);
+    atomic_init (&(worker.spin_budget_ns), 0);
+    _tpool_stats_init (&(worker.stats));
+    if(sem_init (&(worker.park_sem), 0, 0) == TPOOL_FAILURE) {
+        perror("sem_init");
+    }
+    else {
+        _tpool_thread_init (tpool);
+        while((retired = _tpool_extra_retire (tpool, &worker)) == TPOOL_FALSE) {
+            //get and process job
+            job = _tpool_start_job (tpool);
+            if(worker.woken == TPOOL_TRUE) {
+                worker.woken = TPOOL_FALSE;
+                if(job == NULL) {
+                    TPOOL_STAT_ADD(worker.stats.empty_wakeups, 1);
+                }
+            }
+            if(job) {
+                _tpool_run_job (tpool, job, NULL);
+                TPOOL_STAT_ADD(worker.stats.jobs, 1);
+                _tpool_end_job (tpool);
+                continue;
+            }
+
+            //wait for job, but not forever, else a surplus extra worker would never retire
+            status = _tpool_worker_idle (&worker, _tpool_now_ns () + TPOOL_EXTRA_LINGER_NS);
+            if(status == TPOOL_FAILURE && errno != ETIMEDOUT) {
+                perror("sem_timedwait");
+                break;
+            }
+        }
+        sem_destroy (&(worker.park_sem));
+    }
+
+    //if the loop broke because of an error, the worker is still counted
+    if(retired == TPOOL_FALSE) {
+        pthread_mutex_lock (&(tpool->wait_lock));
+        _tpool_extra_fold (tpool, &worker);
+        atomic_fetch_sub (&(tpool->extra_count), 1);
+        pthread_cond_broadcast (&(tpool->wait_cond));
+        pthread_mutex_unlock (&(tpool->wait_lock));
+    }
+    return NULL;
+}
+/* <==========================================> */
+/**
+ * @brief       Checks if the calling extra worker must exit, i.e. if the tpool is being destroyed
+ *                  or if there are more extra workers than open blocking regions. If so, the worker
+ *                  is removed from extra_count (and tpool_destroy is notified) before returning
+ * 
+ * @param tpool the tpool
+ * @param worker the extra worker, whose counters are added to the tpool's if it retires
+ * @return int  TPOOL_TRUE if the worker must exit, else TPOOL_FALSE
+ */
+static int _tpool_extra_retire (tpool_t *tpool, struct _tpool_worker_s *worker)
+{
+    int ret = TPOOL_FALSE;
+    //cheap check first, the lock is only taken if the worker is likely to retire
+    if(tpool->exit_flag == TPOOL_TRUE ||
+            atomic_load (&(tpool->extra_count)) > atomic_load (&(tpool->blocking))) {
+        pthread_mutex_lock (&(tpool->wait_lock));
+        if(tpool->exit_flag == TPOOL_TRUE ||
+                atomic_load (&(tpool->extra_count)) > atomic_load (&(tpool->blocking))) {
+            _tpool_extra_fold (tpool, worker);
+            atomic_fetch_sub (&(tpool->extra_count), 1);
+            pthread_cond_broadcast (&(tpool->wait_cond));
+            ret = TPOOL_TRUE;
+        }
+        pthread_mutex_unlock (&(tpool->wait_lock));
+    }
+    return ret;
+}
+/* <==========================================> */
+/**
+ * @brief       Adds the counters of an extra worker that retires to the tpool's, with wait_lock
+ *                  held. Must be done before extra_count drops, since tpool_destroy may free the
+ *                  tpool after that
+ * 
+ * @param tpool the tpool
+ * @param worker the extra worker
+ */
+static void _tpool_extra_fold (tpool_t *tpool, struct _tpool_worker_s *worker)
+{
+    struct _tpool_wstats_s *from = &(worker->stats);
+    struct _tpool_wstats_s *to = &(tpool->extra_stats);
+    TPOOL_STAT_ADD(to->jobs, atomic_load (&(from->jobs)));
+    TPOOL_STAT_ADD(to->busy_ns, atomic_load (&(from->busy_ns)) + (_tpool_now_ns () - atomic_load (&(from->since_ns))));
+    TPOOL_STAT_ADD(to->idle_ns, atomic_load (&(from->idle_ns)));
+    TPOOL_STAT_ADD(to->wakeups, atomic_load (&(from->wakeups)));
+    TPOOL_STAT_ADD(to->empty_wakeups, atomic_load (&(from->empty_wakeups)));
+}
+/* <==========================================> */
+/**
+ * @brief       Initialises the latency histograms of a worker
+ * 
+ * @param lat   the histograms
+ */
+static void _tpool_lat_init (struct _tpool_lat_s *lat)
+{
+    struct _tpool_hist_s *hists[2] = { &(lat->wait), &(lat->exec) };
+    int i, j;
+    for(i=0; i<2; i++) {
+        atomic_init (&(hists[i]->count), 0);
+        atomic_init (&(hists[i]->sum_ns), 0);
+        atomic_init (&(hists[i]->max_ns), 0);
+        for(j=0; j<TPOOL_HIST_BUCKETS; j++) {
+            atomic_init (&(hists[i]->buckets[j]), 0);
+        }
+    }
+}
+/* <==========================================> */
+/**
+ * @brief       Returns the histogram bucket of a value: the values below 2^TPOOL_HIST_SUB_BITS
+ *                  are their own bucket, the others are split by their highest set bit and the
+ *                  TPOOL_HIST_SUB_BITS bits below it
+ * 
+ * @param ns    the value
+ * @return int  the index of the bucket
+ */
+static int _tpool_hist_index (long ns)
+{
+    int shift;
+    if(ns < (1L << TPOOL_HIST_SUB_BITS)) {
+        return (ns > 0) ? (int)ns : 0;
+    }
+    if(ns >= (1L << TPOOL_HIST_MAX_BITS)) {
+        return TPOOL_HIST_BUCKETS - 1;
+    }
+    shift = (int)(sizeof(long) * CHAR_BIT - 1) - __builtin_clzl ((unsigned long)ns) - TPOOL_HIST_SUB_BITS;
+    return ((shift + 1) << TPOOL_HIST_SUB_BITS) + (int)((ns >> shift) - (1L << TPOOL_HIST_SUB_BITS));
+}
+/* <==========================================> */
+/**
+ * @brief       Records a value in a histogram. The histogram of a worker is only written by the
+ *                  worker itself, so it takes no atomic read-modify-writes
+ * 
+ * @param hist  the histogram
+ * @param ns    the value
+ * @param shared TPOOL_TRUE if other threads may record in the histogram at the same time
+ */
+static void _tpool_hist_add (struct _tpool_hist_s *hist, long ns, int shared)
+{
+    int idx;
+    if(ns < 0) {
+        ns = 0;
+    }
+    idx = _tpool_hist_index (ns);
+    if(shared) {
+        unsigned long max = atomic_load_explicit (&(hist->max_ns), memory_order_relaxed);
+        atomic_fetch_add_explicit (&(hist->count), 1, memory_order_relaxed);
+        atomic_fetch_add_explicit (&(hist->sum_ns), ns, memory_order_relaxed);
+        atomic_fetch_add_explicit (&(hist->buckets[idx]), 1, memory_order_relaxed);
+        while((unsigned long)ns > max &&
+                !atomic_compare_exchange_weak_explicit (&(hist->max_ns), &max, ns, memory_order_relaxed, memory_order_relaxed)) {
+        }
+        return;
+    }
+    TPOOL_STAT_ADD(hist->count, 1);
+    TPOOL_STAT_ADD(hist->sum_ns, ns);
+    TPOOL_STAT_ADD(hist->buckets[idx], 1);
+    if((unsigned long)ns > atomic_load_explicit (&(hist->max_ns), memory_order_relaxed)) {
+        atomic_store_explicit (&(hist->max_ns), ns, memory_order_relaxed);
+    }
+}
+/* <==========================================> */
+/**
+ * @brief       Adds a histogram to a snapshot, without stopping its writer
+ * 
+ * @param hist  the histogram
+ * @param out   the snapshot
+ */
+static void _tpool_hist_read (struct _tpool_hist_s *hist, tpool_hist_t *out)
+{
+    unsigned long max = atomic_load_explicit (&(hist->max_ns), memory_order_relaxed);
+    int i;
+    out->count  += atomic_load_explicit (&(hist->count), memory_order_relaxed);
+    out->sum_ns += atomic_load_explicit (&(hist->sum_ns), memory_order_relaxed);
+    if(max > out->max_ns) {
+        out->max_ns = max;
+    }
+    for(i=0; i<TPOOL_HIST_BUCKETS; i++) {
+        out->buckets[i] += atomic_load_explicit (&(hist->buckets[i]), memory_order_relaxed);
+    }
+}
+/* <==========================================> */
+/**
+ * @brief       Returns the thread id of the calling thread, cached after the first call
+ * 
+ * @return int  the thread id
+ */
+static int _tpool_gettid (void)
+{
+    if(_tpool_tid == 0) {
+        _tpool_tid = (int)syscall (SYS_gettid);
+    }
+    return _tpool_tid;
+}
+/* <==========================================> */
+/**
+ * @brief       Initialises a profiler table, with all the slots free
+ * 
+ * @param prof  the table
+ */
+static void _tpool_prof_init (struct _tpool_prof_s *prof)
+{
+    int i;
+    for(i=0; i<=TPOOL_PROF_SLOTS; i++) {
+        atomic_init (&(prof->slot[i].fn), 0);
+        atomic_init (&(prof->slot[i].calls), 0);
+        atomic_init (&(prof->slot[i].wall_ns), 0);
+        atomic_init (&(prof->slot[i].max_ns), 0);
+        atomic_init (&(prof->slot[i].cpu_ns), 0);
+    }
+}
+/* <==========================================> */
+/**
+ * @brief       Counts a job in a profiler table. The slot of the job function is found by linear
+ *                  probing from the hash of its address, and a free slot is taken for a new one.
+ *                  If the table is full, the job is counted in the extra slot. In the shared
+ *                  table, free slots are claimed with a compare and swap
+ * 
+ * @param prof  the table
+ * @param fn    the job function
+ * @param wall_ns the wall time of the job
+ * @param cpu_ns the CPU time of the job
+ * @param shared TPOOL_TRUE if other threads may write the table at the same time
+ */
+static void _tpool_prof_add (struct _tpool_prof_s *prof, void (*fn)(void*), long wall_ns, long cpu_ns, int shared)
+{
+    uintptr_t key = (uintptr_t)fn;
+    unsigned int i = (unsigned int)(((unsigned long long)key * 0x9E3779B97F4A7C15ULL) >> (64 - TPOOL_PROF_BITS));
+    struct _tpool_prof_slot_s *slot = &(prof->slot[TPOOL_PROF_SLOTS]);
+    int n;
+    if(wall_ns < 0) {
+        wall_ns = 0;
+    }
+    if(cpu_ns < 0) {
+        cpu_ns = 0;
+    }
+    for(n=0; n<TPOOL_PROF_SLOTS; n++, i = (i + 1) & (TPOOL_PROF_SLOTS - 1)) {
+        uintptr_t cur = atomic_load_explicit (&(prof->slot[i].fn), memory_order_relaxed);
+        if(cur == 0) {
+            if(shared == TPOOL_FALSE) {
+                atomic_store_explicit (&(prof->slot[i].fn), key, memory_order_relaxed);
+                cur = key;
+            }
+            else if(atomic_compare_exchange_strong_explicit (&(prof->slot[i].fn), &cur, key,
+                                                             memory_order_relaxed, memory_order_relaxed)) {
+                cur = key;
+            }
+        }
+        if(cur == key) {
+            slot = &(prof->slot[i]);
+            break;
+        }
+    }
+
+    if(shared) {
+        unsigned long max = atomic_load_explicit (&(slot->max_ns), memory_order_relaxed);
+        atomic_fetch_add_explicit (&(slot->calls), 1, memory_order_relaxed);
+        atomic_fetch_add_explicit (&(slot->wall_ns), wall_ns, memory_order_relaxed);
+        atomic_fetch_add_explicit (&(slot->cpu_ns), cpu_ns, memory_order_relaxed);
+        while((unsigned long)wall_ns > max &&
+                !atomic_compare_exchange_weak_explicit (&(slot->max_ns), &max, wall_ns, memory_order_relaxed, memory_order_relaxed)) {
+        }
+        return;
+    }
+    TPOOL_STAT_ADD(slot->calls, 1);
+    TPOOL_STAT_ADD(slot->wall_ns, wall_ns);
+    TPOOL_STAT_ADD(slot->cpu_ns, cpu_ns);
+    if((unsigned long)wall_ns > atomic_load_explicit (&(slot->max_ns), memory_order_relaxed)) {
+        atomic_store_explicit (&(slot->max_ns), wall_ns, memory_order_relaxed);
+    }
+}
+/* <==========================================> */
+/**
+ * @brief       Merges a profiler table into a list of entries, one per job function
+ * 
+ * @param prof  the table
+ * @param entries the list
+ * @param count the number of entries in the list
+ * @param max   the size of the list
+ * @return int  the new number of entries in the list
+ */
+static int _tpool_prof_merge (struct _tpool_prof_s *prof, tpool_prof_entry_t *entries, int count, int max)
+{
+    int i, j;
+    for(i=0; i<=TPOOL_PROF_SLOTS; i++) {
+        struct _tpool_prof_slot_s *slot = &(prof->slot[i]);
+        unsigned long calls = atomic_load_explicit (&(slot->calls), memory_order_relaxed);
+        void (*fn)(void*) = (void (*)(void*))atomic_load_explicit (&(slot->fn), memory_order_relaxed);
+        unsigned long max_ns = atomic_load_explicit (&(slot->max_ns), memory_order_relaxed);
+        if(calls == 0) {
+            continue;
+        }
+        for(j=0; j<count && entries[j].fn != fn; j++) {
+        }
+        if(j == count) {
+            if(count == max) {
+                continue;
+            }
+            memset (&(entries[count]), 0, sizeof(entries[count]));
+            entries[count].fn = fn;
+            count++;
+        }
+        entries[j].calls    += calls;
+        entries[j].wall_ns  += atomic_load_explicit (&(slot->wall_ns), memory_order_relaxed);
+        entries[j].cpu_ns   += atomic_load_explicit (&(slot->cpu_ns), memory_order_relaxed);
+        if(max_ns > entries[j].max_ns) {
+            entries[j].max_ns = max_ns;
+        }
+    }
+    return count;
+}
+/* <==========================================> */
+/**
+ * @brief       qsort comparator for the profile entries, by CPU time and then wall time, highest
+ *                  first
+ */
+static int _tpool_prof_cmp (const void *a, const void *b)
+{
+    const tpool_prof_entry_t *x = a;
+    const tpool_prof_entry_t *y = b;
+    if(x->cpu_ns != y->cpu_ns) {
+        return (x->cpu_ns < y->cpu_ns) ? 1 : -1;
+    }
+    if(x->wall_ns != y->wall_ns) {
+        return (x->wall_ns < y->wall_ns) ? 1 : -1;
+    }
+    return 0;
+}
+/* <==========================================> */
+/**
+ * @brief       Names a function with dladdr: its symbol (and the offset into it), else its
+ *                  address and the object that contains it
+ * 
+ * @param fn    the function
+ * @param buf   filled with the name
+ * @param size  the size of buf
+ */
+static void _tpool_fn_name (void (*fn)(void*), char *buf, size_t size)
+{
+    Dl_info info;
+    if(dladdr ((void*)fn, &info) == 0) {
+        snprintf (buf, size, "%p", (void*)fn);
+    }
+    else if(info.dli_sname == NULL) {
+        snprintf (buf, size, "%p (%s)", (void*)fn, info.dli_fname);
+    }
+    else if((void*)fn != info.dli_saddr) {
+        snprintf (buf, size, "%s+0x%lx", info.dli_sname, (unsigned long)((char*)fn - (char*)info.dli_saddr));
+    }
+    else {
+        snprintf (buf, size, "%s", info.dli_sname);
+    }
+}
+/* <==========================================> */
+/**
+ * @brief       Starts the monitor thread of a tpool, which sleeps on a CLOCK_MONOTONIC condition
+ *                  variable between its rounds, so that tpool_join can wake it up to exit
+ * 
+ * @param tpool the tpool
+ * @return int  Returns 0 on success, -1 on failure
+ */
+static int _tpool_monitor_start (tpool_t *tpool)
+{
+    pthread_condattr_t cattr;
+    int status;
+    if(pthread_mutex_init (&(tpool->monitor_lock), NULL) != 0) {
+        perror("pthread_mutex_init");
+        return TPOOL_FAILURE;
+    }
+    if(pthread_condattr_init (&cattr) != 0) {
+        perror("pthread_condattr_init");
+        pthread_mutex_destroy (&(tpool->monitor_lock));
+        return TPOOL_FAILURE;
+    }
+    pthread_condattr_setclock (&cattr, CLOCK_MONOTONIC);
+    status = pthread_cond_init (&(tpool->monitor_cond), &cattr);
+    pthread_condattr_destroy (&cattr);
+    if(status != 0) {
+        perror("pthread_cond_init");
+        pthread_mutex_destroy (&(tpool->monitor_lock));
+        return TPOOL_FAILURE;
+    }
+    tpool->monitor_stop = TPOOL_FALSE;
+    status = pthread_create (&(tpool->monitor), NULL, _tpool_monitor_thread, tpool);
+    if(status != 0) {
+        errno = status;
+        perror("pthread_create");
+        pthread_cond_destroy (&(tpool->monitor_cond));
+        pthread_mutex_destroy (&(tpool->monitor_lock));
+        return TPOOL_FAILURE;
+    }
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief       Stops the monitor thread of a tpool and waits for it to exit
+ * 
+ * @param tpool the tpool
+ */
+static void _tpool_monitor_stop (tpool_t *tpool)
+{
+    pthread_mutex_lock (&(tpool->monitor_lock));
+    tpool->monitor_stop = TPOOL_TRUE;
+    pthread_cond_signal (&(tpool->monitor_cond));
+    pthread_mutex_unlock (&(tpool->monitor_lock));
+    pthread_join (tpool->monitor, NULL);
+    pthread_cond_destroy (&(tpool->monitor_cond));
+    pthread_mutex_destroy (&(tpool->monitor_lock));
+    tpool->monitor_on = TPOOL_FALSE;
+}
+/* <==========================================> */
+/**
+ * @brief       The thread function of the monitor, which runs the watchdog and publishes the stats
+ *                  segment. The watchdog checks the workers 4 times per threshold, so a stuck job
+ *                  is reported within 1.25 times the threshold (plus the resolution of the coarse
+ *                  clock). Each round does both, at the shorter of the two periods
+ * 
+ * @param arg   the tpool
+ * @return void* always returns NULL
+ */
+static void *_tpool_monitor_thread (void *arg)
+{
+    tpool_t *tpool = arg;
+    long threshold_us = tpool->watchdog_ns / 1000;
+    long period_ns = LONG_MAX;
+    struct timespec ts;
+    if(tpool->watchdog_ns > 0) {
+        period_ns = tpool->watchdog_ns / 4;
+    }
+    if(tpool->shm && tpool->shm_interval_ns < period_ns) {
+        period_ns = tpool->shm_interval_ns;
+    }
+    if(period_ns < 1000000L) {
+        period_ns = 1000000L;
+    }
+    pthread_mutex_lock (&(tpool->monitor_lock));
+    while(tpool->monitor_stop == TPOOL_FALSE) {
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+        ts.tv_nsec += period_ns;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        //a spurious wakeup only checks early
+        pthread_cond_timedwait (&(tpool->monitor_cond), &(tpool->monitor_lock), &ts);
+        if(tpool->monitor_stop == TPOOL_TRUE) {
+            break;
+        }
+        pthread_mutex_unlock (&(tpool->monitor_lock));
+        if(tpool->watchdog_ns > 0) {
+            _tpool_watchdog_check (tpool, threshold_us);
+        }
+        if(tpool->shm) {
+            _tpool_shm_publish (tpool, TPOOL_FALSE);
+        }
+        pthread_mutex_lock (&(tpool->monitor_lock));
+    }
+    pthread_mutex_unlock (&(tpool->monitor_lock));
+    return NULL;
+}
+/* <==========================================> */
+/**
+ * @brief       Reports the jobs that have been running for longer than the threshold, once per
+ *                  job. The job published by a worker is read as with a seqlock: it is only
+ *                  consistent if its start time is the same before and after
+ * 
+ * @param tpool the tpool
+ * @param threshold_us the watchdog threshold in us
+ */
+static void _tpool_watchdog_check (tpool_t *tpool, long threshold_us)
+{
+    long now = _tpool_coarse_us ();
+    tpool_stuck_job_t job;
+    char name[256];
+    int i;
+    for(i=0; i<tpool->tcount; i++) {
+        struct _tpool_worker_s *worker = &(tpool->workers[i]);
+        long start = atomic_load_explicit (&(worker->job_start_us), memory_order_acquire);
+        if(start == 0 || start == worker->job_seen || now - start < threshold_us) {
+            continue;
+        }
+        job.fn  = (void (*)(void*))atomic_load_explicit (&(worker->job_fn), memory_order_relaxed);
+        job.arg = (void*)atomic_load_explicit (&(worker->job_arg), memory_order_relaxed);
+        atomic_thread_fence (memory_order_acquire);
+        if(atomic_load_explicit (&(worker->job_start_us), memory_order_relaxed) != start) {
+            continue;
+        }
+        worker->job_seen = start;
+        job.worker = i;
+        job.thread = worker->thread;
+        job.tid = atomic_load_explicit (&(worker->tid), memory_order_relaxed);
+        job.running_ns = (now - start) * 1000;
+
+        if(tpool->watchdog_fn) {
+            tpool->watchdog_fn (tpool, &job, tpool->watchdog_arg);
+        }
+        else {
+            _tpool_fn_name (job.fn, name, sizeof(name));
+            fprintf (stderr, "tpool: worker %d (tid %d) has been running job %s(%p) for %ld ms\n",
+                     job.worker, job.tid, name, job.arg, job.running_ns / 1000000L);
+        }
+    }
+}
+/* <==========================================> */
+/**
+ * @brief       Creates the stats segment of a tpool, replacing a stale one of the same name. Called
+ *                  once the workers are created, the monitor thread publishes the first snapshot
+ * 
+ * @param tpool the tpool
+ * @param name  the name of the segment
+ * @return int  Returns 0 on success, -1 on failure
+ */
+static int _tpool_shm_create (tpool_t *tpool, const char *name)
+{
+    struct _tpool_shm_seg_s *seg;
+    size_t size = sizeof(*seg) + tpool->tcount * sizeof(tpool_worker_stats_t);
+    int fd;
+    tpool->shm_name = strdup (name);
+    if(tpool->shm_name == NULL) {
+        perror("strdup");
+        return TPOOL_FAILURE;
+    }
+    //a new segment, so that the viewers still attached to an old one don't see it change
+    shm_unlink (name);
+    fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if(fd == TPOOL_FAILURE) {
+        perror("shm_open");
+        free(tpool->shm_name);
+        tpool->shm_name = NULL;
+        return TPOOL_FAILURE;
+    }
+    if(ftruncate (fd, size) == TPOOL_FAILURE) {
+        perror("ftruncate");
+        close (fd);
+        shm_unlink (name);
+        free(tpool->shm_name);
+        tpool->shm_name = NULL;
+        return TPOOL_FAILURE;
+    }
+    seg = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    if(seg == MAP_FAILED) {
+        perror("mmap");
+        shm_unlink (name);
+        free(tpool->shm_name);
+        tpool->shm_name = NULL;
+        return TPOOL_FAILURE;
+    }
+    //the segment is zero filled
+    seg->version = TPOOL_SHM_VERSION;
+    seg->tcount = tpool->tcount;
+    seg->snap_size = sizeof(tpool_shm_stats_t);
+    seg->worker_size = sizeof(tpool_worker_stats_t);
+    seg->snap.pid = getpid ();
+    seg->snap.workers = tpool->tcount;
+    seg->snap.interval_ns = tpool->shm_interval_ns;
+    tpool->shm = seg;
+    tpool->shm_size = size;
+    atomic_store_explicit (&(seg->magic), TPOOL_SHM_MAGIC, memory_order_release);
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief       Writes a snapshot of the stats of a tpool to its stats segment, under the seqlock.
+ *                  Only called by one thread at a time (the monitor thread, then tpool_join)
+ * 
+ * @param tpool the tpool
+ * @param closed TPOOL_TRUE for the last snapshot
+ */
+static void _tpool_shm_publish (tpool_t *tpool, int closed)
+{
+    struct _tpool_shm_seg_s *seg = tpool->shm;
+    unsigned long seq = atomic_load_explicit (&(seg->seq), memory_order_relaxed);
+    int i;
+    atomic_store_explicit (&(seg->seq), seq + 1, memory_order_relaxed);
+    atomic_thread_fence (memory_order_release);
+    seg->snap.closed = closed;
+    seg->snap.time_ns = _tpool_now_ns ();
+    tpool_get_stats (tpool, &(seg->snap.stats));
+    tpool_get_queue_stats (tpool, &(seg->snap.queue), TPOOL_FALSE);
+    tpool_get_latency (tpool, TPOOL_LATENCY_ALL, &(seg->snap.latency));
+    for(i=0; i<seg->tcount; i++) {
+        tpool_get_worker_stats (tpool, i, &(seg->workers[i]));
+    }
+    atomic_store_explicit (&(seg->seq), seq + 2, memory_order_release);
+}
+/* <==========================================> */
+/**
+ * @brief       Publishes the last snapshot of a tpool, then unmaps and unlinks its stats segment.
+ *                  The viewers that are attached keep their mapping
+ * 
+ * @param tpool the tpool
+ */
+static void _tpool_shm_close (tpool_t *tpool)
+{
+    _tpool_shm_publish (tpool, TPOOL_TRUE);
+    if(munmap (tpool->shm, tpool->shm_size) == TPOOL_FAILURE) {
+        perror("munmap");
+    }
+    if(shm_unlink (tpool->shm_name) == TPOOL_FAILURE) {
+        perror("shm_unlink");
+    }
+    free(tpool->shm_name);
+    tpool->shm = NULL;
+    tpool->shm_name = NULL;
+}
+/* <==========================================> */
+/**
+ * @brief       Escapes a label value for the Prometheus text format, i.e. the backslashes, double
+ *                  quotes and newlines
+ * 
+ * @param name  the value
+ * @param buf   filled with the escaped value
+ * @param size  the size of buf, at least 2 * TPOOL_NAME_MAX
+ */
+static void _tpool_metrics_label (const char *name, char *buf, size_t size)
+{
+    size_t len = 0;
+    for(; *name && len + 3 < size; name++) {
+        if(*name == '\\' || *name == '"') {
+            buf[len++] = '\\';
+            buf[len++] = *name;
+        }
+        else if(*name == '\n') {
+            buf[len++] = '\\';
+            buf[len++] = 'n';
+        }
+        else {
+            buf[len++] = *name;
+        }
+    }
+    buf[len] = '\0';
+}
+/* <==========================================> */
+/**
+ * @brief       Writes a latency histogram in the Prometheus text format, in seconds. The log-linear
+ *                  buckets are summed up to each of the _tpool_metrics_le bounds, a bucket is
+ *                  counted below a bound if it starts below it, which is exact to within the
+ *                  bucket width (1/16)
+ * 
+ * @param fp    the file to write to
+ * @param metric the name of the metric
+ * @param help  the help text of the metric
+ * @param pool  the escaped pool label
+ * @param hist  the histogram
+ */
+static void _tpool_metrics_hist (FILE *fp, const char *metric, const char *help, const char *pool, const tpool_hist_t *hist)
+{
+    unsigned long count = 0;
+    int i, b = 0;
+    fprintf (fp, "# HELP %s %s\n# TYPE %s histogram\n", metric, help, metric);
+    for(i=0; i<(int)(sizeof(_tpool_metrics_le) / sizeof(_tpool_metrics_le[0])); i++) {
+        while(b < TPOOL_HIST_BUCKETS && tpool_hist_bucket_ns (b) < _tpool_metrics_le[i]) {
+            count += hist->buckets[b++];
+        }
+        fprintf (fp, "%s_bucket{pool=\"%s\",le=\"%g\"} %lu\n", metric, pool, _tpool_metrics_le[i] / 1e9, count);
+    }
+    fprintf (fp, "%s_bucket{pool=\"%s\",le=\"+Inf\"} %lu\n", metric, pool, hist->count);
+    fprintf (fp, "%s_sum{pool=\"%s\"} %.9f\n", metric, pool, hist->sum_ns / 1e9);
+    fprintf (fp, "%s_count{pool=\"%s\"} %lu\n", metric, pool, hist->count);
+}
+/* <==========================================> */
+/**
+ * @brief       Sets up the trace rings of a new tpool, in the block of the workers array after the
+ *                  profiler tables. One ring per worker, and the shared one last, followed by the
+ *                  events of the rings
+ * 
+ * @param tpool the tpool, with the workers array allocated
+ * @param rings where the rings go
+ * @param count the number of workers
+ * @param events the number of events per ring, a power of 2. 0 => no tracer
+ */
+static void _tpool_trace_init (tpool_t *tpool, struct _tpool_trace_ring_s *rings, int count, long events)
+{
+    struct _tpool_trace_ev_s *ev;
+    long j;
+    int i;
+    if(events == 0) {
+        tpool->trace = NULL;
+        tpool->trace_count = 0;
+        return;
+    }
+    tpool->trace = rings;
+    tpool->trace_count = count + 1;
+    ev = (struct _tpool_trace_ev_s*)(tpool->trace + count + 1);
+    for(i=0; i<=count; i++) {
+        atomic_init (&(tpool->trace[i].head), 0);
+        atomic_init (&(tpool->trace[i].tid), 0);
+        tpool->trace[i].mask = events - 1;
+        tpool->trace[i].ev = ev + i * events;
+        for(j=0; j<events; j++) {
+            atomic_init (&(tpool->trace[i].ev[j].seq), 0);
+        }
+    }
+}
+/* <==========================================> */
+/**
+ * @brief       Records an event in the trace ring of the calling thread: its own if it is a
+ *                  worker of the tpool, else the shared one. The tpool must have a tracer
+ * 
+ * @param tpool the tpool
+ * @param type  one of the TPOOL_TRACE_* values
+ * @param job   the job of the event, NULL if none
+ */
+static void _tpool_trace (tpool_t *tpool, int type, struct _tpool_job_s *job)
+{
+    struct _tpool_trace_ring_s *ring;
+    struct _tpool_trace_ev_s *ev;
+    unsigned long idx;
+    if(_tpool_self && _tpool_self->tpool == tpool && _tpool_self->trace) {
+        ring = _tpool_self->trace;
+        idx = atomic_load_explicit (&(ring->head), memory_order_relaxed);
+        atomic_store_explicit (&(ring->head), idx + 1, memory_order_relaxed);
+    }
+    else {
+        ring = &(tpool->trace[tpool->trace_count - 1]);
+        idx = atomic_fetch_add_explicit (&(ring->head), 1, memory_order_relaxed);
+    }
+    ev = &(ring->ev[idx & ring->mask]);
+    atomic_store_explicit (&(ev->seq), 2 * idx + 1, memory_order_relaxed);
+    atomic_thread_fence (memory_order_release);
+    atomic_store_explicit (&(ev->ts_ns), _tpool_now_ns (), memory_order_relaxed);
+    atomic_store_explicit (&(ev->id), (job) ? job->trace_id : 0, memory_order_relaxed);
+    atomic_store_explicit (&(ev->fn), (job) ? (uintptr_t)job->fn_ptr : 0, memory_order_relaxed);
+    atomic_store_explicit (&(ev->tid), _tpool_gettid (), memory_order_relaxed);
+    atomic_store_explicit (&(ev->type), type, memory_order_relaxed);
+    atomic_store_explicit (&(ev->seq), 2 * idx + 2, memory_order_release);
+}
+/* <==========================================> */
+/**
+ * @brief       Writes the events of a trace ring as Chrome trace events. The jobs are B/E slices
+ *                  named after their job function, linked by a flow to the instant event of their
+ *                  enqueue. The events that are overwritten while they are read are skipped, and
+ *                  so are the ends of a worker's slices whose beginning was overwritten
+ * 
+ * @param ring  the ring
+ * @param idx   the index of the worker, -1 for the shared ring
+ * @param fp    the file
+ */
+static void _tpool_trace_write (struct _tpool_trace_ring_s *ring, int idx, FILE *fp)
+{
+    unsigned long head = atomic_load_explicit (&(ring->head), memory_order_acquire);
+    unsigned long i = (head > ring->mask + 1) ? head - (ring->mask + 1) : 0;
+    int pid = (int)getpid ();
+    int tid = atomic_load_explicit (&(ring->tid), memory_order_relaxed);
+    int running = 0;
+    int parked = TPOOL_FALSE;
+
+    if(idx >= 0 && tid != 0) {
+        fprintf (fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}",
+                 pid, tid, idx);
+    }
+    for(; i<head; i++) {
+        struct _tpool_trace_ev_s *ev = &(ring->ev[i & ring->mask]);
+        unsigned long seq = atomic_load_explicit (&(ev->seq), memory_order_acquire);
+        if(seq != 2 * i + 2) {
+            continue;
+        }
+        long ts = atomic_load_explicit (&(ev->ts_ns), memory_order_relaxed);
+        unsigned long id = atomic_load_explicit (&(ev->id), memory_order_relaxed);
+        void *fn = (void*)atomic_load_explicit (&(ev->fn), memory_order_relaxed);
+        int etid = atomic_load_explicit (&(ev->tid), memory_order_relaxed);
+        int type = atomic_load_explicit (&(ev->type), memory_order_relaxed);
+        atomic_thread_fence (memory_order_acquire);
+        if(atomic_load_explicit (&(ev->seq), memory_order_relaxed) != seq) {
+            continue;
+        }
+        double us = ts / 1000.0;
+
+        switch(type) {
+            case TPOOL_TRACE_ENQUEUE:
+                fprintf (fp, ",\n{\"name\":\"enqueue\",\"cat\":\"tpool\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,"
+                         "\"args\":{\"job\":%lu,\"fn\":\"%p\"}}", pid, etid, us, id, fn);
+                fprintf (fp, ",\n{\"name\":\"job\",\"cat\":\"tpool\",\"ph\":\"s\",\"id\":%lu,\"pid\":%d,\"tid\":%d,\"ts\":%.3f}",
+                         id, pid, etid, us);
+                break;
+            case TPOOL_TRACE_START:
+                running++;
+                fprintf (fp, ",\n{\"name\":\"%p\",\"cat\":\"job\",\"ph\":\"B\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,"
+                         "\"args\":{\"job\":%lu}}", fn, pid, etid, us, id);
+                fprintf (fp, ",\n{\"name\":\"job\",\"cat\":\"tpool\",\"ph\":\"f\",\"bp\":\"e\",\"id\":%lu,\"pid\":%d,\"tid\":%d,\"ts\":%.3f}",
+                         id, pid, etid, us);
+                break;
+            case TPOOL_TRACE_END:
+                if(idx >= 0 && running == 0) {
+                    break;
+                }
+                running--;
+                fprintf (fp, ",\n{\"ph\":\"E\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f}", pid, etid, us);
+                break;
+            case TPOOL_TRACE_PARK:
+                parked = TPOOL_TRUE;
+                fprintf (fp, ",\n{\"name\":\"parked\",\"cat\":\"idle\",\"ph\":\"B\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f}",
+                         pid, etid, us);
+                break;
+            case TPOOL_TRACE_UNPARK:
+                if(idx >= 0 && parked == TPOOL_FALSE) {
+                    break;
+                }
+                parked = TPOOL_FALSE;
+                fprintf (fp, ",\n{\"ph\":\"E\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f}", pid, etid, us);
+                break;
+        }
+    }
+}
+/* <==========================================> */
+/**
+ * @brief       Maps one region that holds the stacks of all the workers, each with a guard area
+ *                  below it. With TPOOL_STACK_HUGEPAGE, hugetlb pages are tried first, then the
+ *                  region is mapped normally and transparent huge pages are requested for it. On
+ *                  success, stack_size and guard_size are updated with the rounded up sizes
+ * 
+ * @param tpool the tpool, with stack_size and guard_size set
+ * @param count the number of workers
+ * @param mode  TPOOL_STACK_PREALLOC or TPOOL_STACK_HUGEPAGE
+ * @return int  Returns 0 on success, -1 on failure
+ */
+static int _tpool_stacks_alloc (tpool_t *tpool, int count, int mode)
+{
+    size_t page = sysconf (_SC_PAGESIZE);
+    size_t stack = tpool->stack_size;
+    size_t guard = tpool->guard_size;
+    size_t size = 0;
+    void *mem = MAP_FAILED;
+    int i;
+
+    //pthread_attr_setstack needs an explicit size, use the one that pthread would have used
+    if(stack == 0) {
+        pthread_attr_t attr;
+        if(pthread_attr_init (&attr) != 0) {
+            return TPOOL_FAILURE;
+        }
+        pthread_attr_getstacksize (&attr, &stack);
+        pthread_attr_destroy (&attr);
+    }
+
+    if(mode == TPOOL_STACK_HUGEPAGE) {
+        //everything has to be huge page aligned for hugetlb mappings, including the guards
+        size = count * (TPOOL_ROUND_UP(stack, TPOOL_HUGEPAGE_SIZE) + TPOOL_ROUND_UP(guard, TPOOL_HUGEPAGE_SIZE));
+        mem = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_HUGETLB, -1, 0);
+        if(mem != MAP_FAILED) {
+            stack = TPOOL_ROUND_UP(stack, TPOOL_HUGEPAGE_SIZE);
+            guard = TPOOL_ROUND_UP(guard, TPOOL_HUGEPAGE_SIZE);
+        }
+        else {
+            //transparent huge pages can only back the stacks that span whole huge pages
+            stack = TPOOL_ROUND_UP(stack, TPOOL_HUGEPAGE_SIZE);
+        }
+    }
+    if(mem == MAP_FAILED) {
+        stack = TPOOL_ROUND_UP(stack, page);
+        guard = TPOOL_ROUND_UP(guard, page);
+        size = count * (stack + guard);
+        mem = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if(mem == MAP_FAILED) {
+            perror("mmap");
+            return TPOOL_FAILURE;
+        }
+        //only a hint, so a failure is not fatal
+        if(mode == TPOOL_STACK_HUGEPAGE && madvise (mem, size, MADV_HUGEPAGE) == TPOOL_FAILURE) {
+            perror("madvise");
+        }
+    }
+
+    //the stacks grow down, so the guard of each worker sits at the bottom of its slot
+    for(i=0; guard && i<count; i++) {
+        if(mprotect ((char*)mem + i*(stack + guard), guard, PROT_NONE) == TPOOL_FAILURE) {
+            perror("mprotect");
+            munmap (mem, size);
+            return TPOOL_FAILURE;
+        }
+    }
+
+    tpool->stack_size       = stack;
+    tpool->guard_size       = guard;
+    tpool->stack_mem        = mem;
+    tpool->stack_mem_size   = size;
+    return TPOOL_SUCCESS;
+}
+/* <==========================================> */
+/**
+ * @brief       Prepares the pthread attributes of a worker from the creation attributes of the
+ *                  tpool. The caller must destroy attr if this succeeds
+ * 
+ * @param tpool the tpool
+ * @param idx   the index of the worker, -1 for an extra worker (which is detached and never uses
+ *                  stack_mem)
+ * @param sched TPOOL_TRUE to set the scheduling policy of the tpool, TPOOL_FALSE to inherit it
+ * @param attr  the attributes to be initialised
+ * @return int  Returns 0 on success, else an error number like the pthread functions
+ */
+static int _tpool_thread_attr (tpool_t *tpool, int idx, int sched, pthread_attr_t *attr)
+{
+    int ret = pthread_attr_init (attr);
+    if(ret != 0) {
+        return ret;
+    }
+    if(idx < 0) {
+        ret = pthread_attr_setdetachstate (attr, PTHREAD_CREATE_DETACHED);
+    }
+    if(ret == 0 && sched && tpool->sched_policy != TPOOL_SCHED_INHERIT) {
+        struct sched_param param = { .sched_priority = tpool->sched_priority };
+        ret = pthread_attr_setinheritsched (attr, PTHREAD_EXPLICIT_SCHED);
+        if(ret == 0) {
+            ret = pthread_attr_setschedpolicy (attr, tpool->sched_policy);
+        }
+        if(ret == 0) {
+            ret = pthread_attr_setschedparam (attr, &param);
+        }
+    }
+    if(ret == 0 && tpool->stack_mem && idx >= 0) {
+        char *slot = (char*)tpool->stack_mem + idx*(tpool->stack_size + tpool->guard_size);
+        ret = pthread_attr_setstack (attr, slot + tpool->guard_size, tpool->stack_size);
+    }
+    else if(ret == 0) {
+        if(tpool->stack_size) {
+            ret = pthread_attr_setstacksize (attr, tpool->stack_size);
+        }
+        if(ret == 0) {
+            ret = pthread_attr_setguardsize (attr, tpool->guard_size);
+        }
+    }
+    if(ret != 0) {
+        pthread_attr_destroy (attr);
+    }
+    return ret;
+}
+/* <==========================================> */
+/**
+ * @brief       Creates a worker thread with the attributes of the tpool. If the process lacks the
+ *                  privileges for the scheduling policy, the thread is created with the inherited
+ *                  one instead. For the regular workers (created one after the other in
+ *                  tpool_create_ex), the tpool also drops the policy, so that this happens once
+ * 
+ * @param tpool  the tpool
+ * @param idx    the index of the worker, -1 for an extra worker
+ * @param thread filled with the pthread handle
+ * @param fn     the thread function
+ * @param arg    the arg for the thread function
+ * @return int   Returns 0 on success, else an error number like the pthread functions
+ */
+static int _tpool_thread_create (tpool_t *tpool, int idx, pthread_t *thread, void *(*fn)(void*), void *arg)
+{
+    pthread_attr_t attr;
+    int ret = _tpool_thread_attr (tpool, idx, TPOOL_TRUE, &attr);
+    if(ret == 0) {
+        ret = pthread_create (thread, &attr, fn, arg);
+        pthread_attr_destroy (&attr);
+    }
+    if(ret == EPERM && tpool->sched_policy != TPOOL_SCHED_INHERIT) {
+        if(idx >= 0) {
+            fprintf(stderr, "tpool: no privileges for scheduling policy %d, using the inherited one\n", tpool->sched_policy);
+            tpool->sched_policy = TPOOL_SCHED_INHERIT;
+        }
+        ret = _tpool_thread_attr (tpool, idx, TPOOL_FALSE, &attr);
+        if(ret == 0) {
+            ret = pthread_create (thread, &attr, fn, arg);
+            pthread_attr_destroy (&attr);
+        }
+    }
+    return ret;
+}
+/* <==========================================> */
+/**
+ * @brief       Per thread setup that can only be done by the worker itself: sets its nice value.
+ *                  Nice values only apply to the non real time policies, and lowering one needs
+ *                  privileges, so a failure is ignored
+ * 
+ * @param tpool the tpool
+ */
+static void _tpool_thread_init (tpool_t *tpool)
+{
+    if(tpool->nice != 0 && tpool->sched_policy != SCHED_FIFO && tpool->sched_policy != SCHED_RR) {
+        //on linux the nice value is per thread, given the thread id
+        setpriority (PRIO_PROCESS, (id_t)syscall (SYS_gettid), tpool->nice);
+    }
+}
+/* <==========================================> */
+/**
+ * @brief               Prepares a job and adds it to the thread pool. Common code for tpool_add_job
+ *                          and tpool_group_add_job
+ * 
+ * @param tpool         The handle to the tpool
+ * @param group         The group that the job is a member of, NULL if none
+ * @param job_fn        The function pointer for the job to be performed
+ * @param arg           The (optional) arg for job_fn
+ * @param destructor    The (optional) destructor for job_fn
+ * @param opt           The options for job to be performed
+ * @return int          Returns 0 on success, -1 on failure
+ */
+static int _tpool_add_job (tpool_t *tpool, struct _tpool_group_s *group, void (*job_fn)(void *), void *arg, void (*destructor)(void*), int opt)
+{
+    int ret = TPOOL_FAILURE;
+    //an invalid submission is not an admission decision, so it is turned away before that
+    if(tpool == NULL || job_fn == NULL || tpool->status != TPOOL_SUCCESS) {
+        return TPOOL_FAILURE;
+    }
+    //an overloaded tpool turns the sheddable jobs away
+    if((opt & TPOOL_SHEDDABLE) && tpool->queue.shed_mode == TPOOL_SHED_REJECT &&
+            atomic_load_explicit (&(tpool->queue.overloaded), memory_order_relaxed) == TPOOL_TRUE) {
+        atomic_fetch_add_explicit (&(tpool->rejected), 1, memory_order_relaxed);
+        errno = EBUSY;
+    }
+    else {
+        struct _tpool_job_s *job = malloc (sizeof(*job));
+        if(job) {
+            //prepare the job struct
+            job->fn_ptr     = job_fn;
+            job->arg        = arg;
+            job->destructor = destructor;
+            job->opt        = opt;
+            job->group      = group;
+            job->enq_ns     = (tpool->queue.shed_target > 0 ||
+                               atomic_load_explicit (&(tpool->timing), memory_order_relaxed)) ? _tpool_now_ns () : 0;
+            job->trace_id   = 0;
+            //traced before the enqueue, since the job may complete (and be freed) right after it
+            if(tpool->trace) {
+                job->trace_id = atomic_fetch_add_explicit (&(tpool->trace_seq), 1, memory_order_relaxed) + 1;
+                _tpool_trace (tpool, TPOOL_TRACE_ENQUEUE, job);
+            }
+
+            job->next       = NULL;
+            job->prev       = NULL;
+
+            //count the job before it can be dequeued, so that it cannot complete before that
+            if(group) {
+                atomic_fetch_add (&(group->pending), 1);
+            }
+            atomic_fetch_add (&(tpool->submitted), 1);
+
+            //add job and notify the workers
+            _tpool_enqueue(&tpool->queue, job);
+            TPOOL_PROBE4(enqueue, tpool, job, job_fn, atomic_load_explicit (&(tpool->queue.len), memory_order_relaxed));
+            if((tpool->flags & TPOOL_ATTR_BUSY_POLL) == 0) {
+                _tpool_wake (tpool);
+            }
+            //threads blocked in a wait may want to help out with this job
+            if(atomic_load (&(tpool->wait_count)) > 0) {
+                pthread_mutex_lock (&(tpool->wait_lock));
+                pthread_cond_broadcast (&(tpool->wait_cond));
+                pthread_mutex_unlock (&(tpool->wait_lock));
+            }
+            ret = TPOOL_SUCCESS;
+        }
+        else {
+            perror("malloc");
+        }
+    }
+    return ret;
+}
+/* <==========================================> */
+/**
+ * @brief       Blocks until the jobs of the given group (or of the tpool) have completed. If help is
+ *                  set, the calling thread runs queued jobs in the meantime instead of just sleeping.
+ *                  _tpool_job_done broadcasts wait_cond while holding wait_lock, so checking the
+ *                  condition again under the lock makes sure that no wakeup is lost
+ * 
+ * @param tpool the tpool
+ * @param group the group to wait for, NULL to wait for the tpool to be idle
+ * @param help  TPOOL_TRUE if queued jobs must be run while waiting
+ */
+static void _tpool_wait_for (tpool_t *tpool, struct _tpool_group_s *group, int help)
+{
+    struct _tpool_job_s *job;
+
+    atomic_fetch_add (&(tpool->wait_count), 1);
+    while(_tpool_is_pending (tpool, group)) {
+        job = NULL;
+        pthread_mutex_lock (&(tpool->wait_lock));
+        if(_tpool_is_pending (tpool, group)) {
+            //tpool_pause checks running under the lock, so it can't miss this job
+            if(help && tpool->paused == TPOOL_FALSE) {
+                job = _tpool_dequeue (&(tpool->queue), NULL);
+                if(job) {
+                    atomic_fetch_add (&(tpool->running), 1);
+                }
+            }
+            if(job == NULL) {
+                pthread_cond_wait (&(tpool->wait_cond), &(tpool->wait_lock));
+            }
+        }
+        pthread_mutex_unlock (&(tpool->wait_lock));
+
+        //run the job outside the lock. The workers may wake up to an empty queue because of
+        //this, which they already handle. Once the tpool is shutting down, the job is handled as
+        //given by the shutdown mode, the same as by the workers
+        if(job) {
+            if(tpool->exit_flag == TPOOL_TRUE) {
+                _tpool_cleanup_job (tpool, job, NULL);
+            }
+            else {
+                _tpool_run_job (tpool, job, NULL);
+            }
+            _tpool_end_job (tpool);
+        }
+    }
+    atomic_fetch_sub (&(tpool->wait_count), 1);
+}
+/* <==========================================> */
+/**
+ * @brief       Checks if the given group (or the tpool) has jobs that have not completed
+ * 
+ * @param tpool the tpool
+ * @param group the group, NULL for the whole tpool
+ * @return int  TPOOL_TRUE if there are such jobs, else TPOOL_FALSE
+ */
+static int _tpool_is_pending (tpool_t *tpool, struct _tpool_group_s *group)
+{
+    if(group) {
+        return (atomic_load (&(group->pending)) > 0);
+    }
+    //load completed first. Both only grow, so the difference can only overestimate the pending
+    //jobs, and the tpool is never reported idle too early
+    unsigned long completed = atomic_load (&(tpool->completed));
+    return (atomic_load (&(tpool->submitted)) != completed);
+}
+/* <==========================================> */
+/**
+ * @brief       Runs a dequeued job and its destructor (if requested for). Used by the workers, by
+ *                  the threads that help out while waiting and by _tpool_cleanup_job during a
+ *                  shutdown
+ * 
+ * @param tpool the tpool that the job belongs to
+ * @param job   the dequeued job
+ * @param worker the regular worker that runs the job, NULL for the other threads, which record
+ *                  into the shared histograms and profiler table of the tpool
+ */
+static void _tpool_run_job (tpool_t *tpool, struct _tpool_job_s *job, struct _tpool_worker_s *worker)
+{
+    //the job may wait on a group and help out in turn, so remember the outer tpool
+    tpool_t *outer = _tpool_cur;
+    int fair = atomic_load_explicit (&(tpool->queue.fair), memory_order_relaxed);
+    //the jobs added before the timing was turned on have no timestamp
+    int timed = (job->enq_ns != 0 && atomic_load_explicit (&(tpool->timing), memory_order_relaxed));
+    int prof = atomic_load_explicit (&(tpool->profiling), memory_order_relaxed);
+    long start = 0;
+    long end = 0;
+    long cpu = 0;
+    if(fair || timed || prof) {
+        start = _tpool_now_ns ();
+    }
+    if(prof) {
+        cpu = _tpool_cpu_ns ();
+    }
+    if(tpool->trace) {
+        _tpool_trace (tpool, TPOOL_TRACE_START, job);
+    }
+    TPOOL_PROBE4(start, tpool, job, job->fn_ptr, atomic_load_explicit (&(tpool->queue.len), memory_order_relaxed));
+    //publish the job for the watchdog, the start time last (as the sequence of a seqlock). Only
+    //the regular workers publish theirs, including the ones they run while shutting down. The
+    //jobs that a worker runs while it helps out inside a job (worker NULL) are covered by the
+    //outer one, the ones of the other threads are not watched
+    if(worker && tpool->watchdog_ns > 0) {
+        atomic_thread_fence (memory_order_release);
+        atomic_store_explicit (&(worker->job_fn), (uintptr_t)job->fn_ptr, memory_order_relaxed);
+        atomic_store_explicit (&(worker->job_arg), (uintptr_t)job->arg, memory_order_relaxed);
+        atomic_store_explicit (&(worker->job_start_us), _tpool_coarse_us (), memory_order_release);
+    }
+    _tpool_cur = tpool;
+    (job->fn_ptr(job->arg));
+    _tpool_cur = outer;
+    if(worker && tpool->watchdog_ns > 0) {
+        atomic_store_explicit (&(worker->job_start_us), 0, memory_order_relaxed);
+    }
+    TPOOL_PROBE4(end, tpool, job, job->fn_ptr, atomic_load_explicit (&(tpool->queue.len), memory_order_relaxed));
+    if(tpool->trace) {
+        _tpool_trace (tpool, TPOOL_TRACE_END, job);
+    }
+    if(prof) {
+        cpu = _tpool_cpu_ns () - cpu;
+    }
+    if(fair || timed || prof) {
+        end = _tpool_now_ns ();
     }
 
-    //unlock queue when done
+    if(timed) {
+        struct _tpool_lat_s *lat = (worker) ? worker->lat : tpool->lat_shared;
+        _tpool_hist_add (&(lat->wait), start - job->enq_ns, (worker == NULL));
+        _tpool_hist_add (&(lat->exec), end - start, (worker == NULL));
+    }
+    if(prof) {
+        _tpool_prof_add ((worker) ? worker->prof : tpool->prof_shared, job->fn_ptr, end - start, cpu, (worker == NULL));
+    }
+
+    //correct the charge of the tenant with the actual cost, and update its estimate
+    if(fair) {
+        struct _tpool_subq_s *sub = &(tpool->queue.sub[TPOOL_TENANT_OF(job->opt)]);
+        long cost = end - start;
+        long est = atomic_load_explicit (&(sub->cost_ns), memory_order_relaxed);
+        atomic_fetch_add_explicit (&(sub->vtime), ((cost - job->charge) * (1L << TPOOL_VTIME_SHIFT)) /
+                                   atomic_load_explicit (&(sub->weight), memory_order_relaxed),
+                                   memory_order_relaxed);
+        atomic_store_explicit (&(sub->cost_ns), est + ((cost - est) >> TPOOL_EWMA_SHIFT), memory_order_relaxed);
+    }
+
+    //if destructor calling is requested for, do it
+    if( (job->opt & TPOOL_RUN_DESTRUCTOR_AFTER_JOB) && job->destructor && job->arg ) {
+        job->destructor(job->arg);
+    }
+    _tpool_job_done (tpool, job);
+}
+/* <==========================================> */
+/**
+ * @brief       Dequeues a job for a worker, unless the tpool is paused (a tpool that is shutting
+ *                  down is never paused). The worker is counted in running first, so that
+ *                  tpool_pause can wait for it. Must be followed by _tpool_end_job if a job is
+ *                  returned. The jobs that the admission control drops on the way are cleaned up
+ * 
+ * @param tpool the tpool
+ * @return struct _tpool_job_s* the job, NULL if there is none or the tpool is paused
+ */
+static struct _tpool_job_s* _tpool_start_job (tpool_t *tpool)
+{
+    struct _tpool_job_s *job = NULL;
+    struct _tpool_job_s *dropped = NULL, *next;
+    atomic_fetch_add (&(tpool->running), 1);
+    if(tpool->paused == TPOOL_FALSE || tpool->exit_flag == TPOOL_TRUE) {
+        job = _tpool_dequeue (&(tpool->queue), &dropped);
+    }
+    //the jobs shed by the admission control are cleaned up outside the queue lock
+    while(dropped) {
+        next = dropped->next;
+        if(dropped->arg && dropped->destructor) {
+            (dropped->destructor) (dropped->arg);
+        }
+        _tpool_job_done (tpool, dropped);
+        atomic_fetch_add_explicit (&(tpool->dropped), 1, memory_order_relaxed);
+        dropped = next;
+    }
+    if(job == NULL) {
+        _tpool_end_job (tpool);
+    }
+    //a refill unblocked some jobs that the producers never woke anyone up for
+    else if(atomic_load_explicit (&(tpool->queue.unblocked), memory_order_relaxed) == TPOOL_TRUE &&
+            atomic_exchange (&(tpool->queue.unblocked), TPOOL_FALSE) == TPOOL_TRUE) {
+        _tpool_wake_n (tpool, _tpool_ready_jobs (&(tpool->queue)));
+    }
+    return job;
+}
+/* <==========================================> */
+/**
+ * @brief       Ends what _tpool_start_job started, and wakes up tpool_pause if it waits for the
+ *                  running jobs
+ * 
+ * @param tpool the tpool
+ */
+static void _tpool_end_job (tpool_t *tpool)
+{
+    if(atomic_fetch_sub (&(tpool->running), 1) == 1 && tpool->paused == TPOOL_TRUE &&
+            atomic_load (&(tpool->wait_count)) > 0) {
+        pthread_mutex_lock (&(tpool->wait_lock));
+        pthread_cond_broadcast (&(tpool->wait_cond));
+        pthread_mutex_unlock (&(tpool->wait_lock));
+    }
+}
+/* <==========================================> */
+/**
+ * @brief       Cleans up a job that was still queued when the tpool is shut down, as given by the
+ *                  shutdown mode. With TPOOL_SHUTDOWN_JOB_OPT, the job is only performed if
+ *                  TPOOL_CLEANUP_RUN_JOB was requested for, its destructor is run if
+ *                  TPOOL_RUN_DESTRUCTOR_AFTER_JOB was requested for. A job that is discarded by the
+ *                  other modes always has its destructor run
+ * 
+ * @param tpool the tpool that the job belongs to
+ * @param job   the dequeued job
+ * @param worker the regular worker that cleans up the job (and runs it, see _tpool_run_job), NULL
+ *                  for the other threads
+ */
+static void _tpool_cleanup_job (tpool_t *tpool, struct _tpool_job_s *job, struct _tpool_worker_s *worker)
+{
+    int run;
+    switch(tpool->shutdown_mode) {
+        case TPOOL_SHUTDOWN_DRAIN:
+            run = TPOOL_TRUE;
+            break;
+        case TPOOL_SHUTDOWN_DISCARD:
+            run = TPOOL_FALSE;
+            break;
+        case TPOOL_SHUTDOWN_DEADLINE:
+            run = (_tpool_now_ns () < tpool->shutdown_deadline);
+            break;
+        default:
+            run = ((job->opt & TPOOL_CLEANUP_RUN_JOB) != 0);
+            break;
+    }
+    //perform the job if requested for
+    if(run) {
+        _tpool_run_job (tpool, job, worker);
+        return;
+    }
+    //cleanup if requested for
+    if(job->arg && job->destructor && ((job->opt & TPOOL_RUN_DESTRUCTOR_AFTER_JOB) ||
+            tpool->shutdown_mode != TPOOL_SHUTDOWN_JOB_OPT) ) {
+        (job->destructor) (job->arg);
+    }
+    _tpool_job_done (tpool, job);
+}
+/* <==========================================> */
+/**
+ * @brief       Frees a job that has been performed or discarded, updates the pending counts and
+ *                  wakes up the waiters, if any
+ * 
+ * @param tpool the tpool that the job belongs to
+ * @param job   the job
+ */
+static void _tpool_job_done (tpool_t *tpool, struct _tpool_job_s *job)
+{
+    //the group may be freed by its waiter as soon as its count drops, so don't touch it after that
+    if(job->group) {
+        atomic_fetch_sub (&(job->group->pending), 1);
+    }
+    free(job);
+    atomic_fetch_add (&(tpool->completed), 1);
+
+    if(atomic_load (&(tpool->wait_count)) > 0) {
+        pthread_mutex_lock (&(tpool->wait_lock));
+        pthread_cond_broadcast (&(tpool->wait_cond));
+        pthread_mutex_unlock (&(tpool->wait_lock));
+    }
+}
+/* <==========================================> */
+/**
+ * @brief       Adds a job to the queue of its class, or of its tenant for class 0, thread safe
+ * 
+ * @param queue queue to which the job needs to be added
+ * @param job   the prepared job structure
+ */
+static void _tpool_enqueue (struct _tpool_q_s *queue, struct _tpool_job_s *job)
+{
+    //it is assumed that queue and job are not NULL, since checks are performed in the caller
+    //it is assumed that the caller has set the job struct links to NULL.
+    int tenant = TPOOL_TENANT_OF(job->opt);
+    int class_id = TPOOL_CLASS_OF(job->opt);
+    struct _tpool_subq_s *sub = &(queue->sub[tenant]);
+    struct _tpool_class_s *cls = &(queue->cls[class_id]);
+    _tpool_queue_lock (queue, TPOOL_LOCK_PRODUCER);
+
+    //the tenant becomes active, it doesn't get credit for the time it was idle
+    if((queue->active & (1U << tenant)) == 0 &&
+            atomic_load_explicit (&(sub->vtime), memory_order_relaxed) < queue->vclock) {
+        atomic_store_explicit (&(sub->vtime), queue->vclock, memory_order_relaxed);
+    }
+    if(tenant != 0 && atomic_load_explicit (&(queue->fair), memory_order_relaxed) == TPOOL_FALSE) {
+        atomic_store_explicit (&(queue->fair), TPOOL_TRUE, memory_order_relaxed);
+    }
+
+    if(class_id == 0) {
+        _tpool_list_push (&(sub->front), &(sub->back), job);
+        queue->active |= (1U << tenant);
+    }
+    else {
+        _tpool_list_push (&(cls->front), &(cls->back), job);
+        cls->count++;
+        if(queue->blocked & (1U << class_id)) {
+            atomic_store_explicit (&(queue->held), atomic_load_explicit (&(queue->held), memory_order_relaxed) + 1, memory_order_relaxed);
+        }
+        else if(cls->count == 1) {
+            //a class that has run out of tokens is blocked as soon as it has jobs again
+            if(cls->rate && queue->unlimited == TPOOL_FALSE) {
+                long now = _tpool_now_ns ();
+                _tpool_class_refill (cls, now);
+                if(cls->tokens < TPOOL_TOKEN) {
+                    _tpool_class_block (queue, class_id, now);
+                }
+            }
+            if((queue->blocked & (1U << class_id)) == 0) {
+                queue->ready |= (1U << class_id);
+            }
+        }
+    }
+    _tpool_queue_len_add (queue, 1);
+    //don't forget to unlock the mutex
+    _tpool_queue_unlock (queue, TPOOL_LOCK_PRODUCER);
+}
+/* <==========================================> */
+/**
+ * @brief       Takes the lock of the queue. With TPOOL_ATTR_LOCK_STATS, a trylock is tried first to
+ *                  find out if the lock is contended, and the time spent waiting is counted for
+ *                  the given side
+ * 
+ * @param queue the queue
+ * @param side  TPOOL_LOCK_PRODUCER or TPOOL_LOCK_CONSUMER
+ */
+static void _tpool_queue_lock (struct _tpool_q_s *queue, int side)
+{
+    struct _tpool_lockstat_s *stat = &(queue->lockstat[side]);
+    long start;
+    if(queue->lock_stats == TPOOL_FALSE) {
+        pthread_mutex_lock (&(queue->lock));
+        return;
+    }
+    if(pthread_mutex_trylock (&(queue->lock)) == 0) {
+        queue->locked_ns = _tpool_now_ns ();
+    }
+    else {
+        start = _tpool_now_ns ();
+        pthread_mutex_lock (&(queue->lock));
+        queue->locked_ns = _tpool_now_ns ();
+        TPOOL_STAT_ADD(stat->contended, 1);
+        TPOOL_STAT_ADD(stat->wait_ns, queue->locked_ns - start);
+    }
+    TPOOL_STAT_ADD(stat->acquired, 1);
+}
+/* <==========================================> */
+/**
+ * @brief       Releases the lock of the queue. With TPOOL_ATTR_LOCK_STATS, the time that it was
+ *                  held for is counted for the given side
+ * 
+ * @param queue the queue
+ * @param side  TPOOL_LOCK_PRODUCER or TPOOL_LOCK_CONSUMER
+ */
+static void _tpool_queue_unlock (struct _tpool_q_s *queue, int side)
+{
+    if(queue->lock_stats) {
+        TPOOL_STAT_ADD(queue->lockstat[side].hold_ns, _tpool_now_ns () - queue->locked_ns);
+    }
     pthread_mutex_unlock (&(queue->lock));
+}
+/* <==========================================> */
+/**
+ * @brief       Changes the length of the queue, with the lock held, and updates its high-water
+ *                  mark. The time-weighted average is kept as the integral of the length over
+ *                  time, as a step function: on the first change after the coarse clock ticks,
+ *                  the length before the change is added for the time since the last update.
+ *                  The coarse clock is a couple of loads from the vDSO page, so it is read on
+ *                  every change
+ * 
+ * @param queue the queue
+ * @param n     the number of jobs added, negative if taken off
+ */
+static void _tpool_queue_len_add (struct _tpool_q_s *queue, long n)
+{
+    long prev = atomic_load_explicit (&(queue->len), memory_order_relaxed);
+    long len = prev + n;
+    long last = atomic_load_explicit (&(queue->len_last_us), memory_order_relaxed);
+    long now = _tpool_coarse_us ();
+    atomic_store_explicit (&(queue->len), len, memory_order_relaxed);
+    if(len > atomic_load_explicit (&(queue->len_max), memory_order_relaxed)) {
+        atomic_store_explicit (&(queue->len_max), len, memory_order_relaxed);
+    }
+    if(now > last) {
+        TPOOL_STAT_ADD(queue->len_area, (unsigned long)prev * (now - last));
+        atomic_store_explicit (&(queue->len_last_us), now, memory_order_relaxed);
+    }
+}
+/* <==========================================> */
+/**
+ * @brief           Remove a job from the queue, thread safe. See _tpool_pick for which job. With
+ *                      admission control, the jobs that it sheds are taken off the queue too
+ * 
+ * @param queue     the queue
+ * @param dropped   where the shed jobs are returned as a list linked through next, to be cleaned
+ *                      up by the caller. NULL => no job is shed
+ * @return          struct _tpool_job_s* pointer to the job, returns NULL if no job is ready
+ */
+static struct _tpool_job_s* _tpool_dequeue (struct _tpool_q_s *queue, struct _tpool_job_s **dropped)
+{
+    //assumes that queue is not NULL and initialised fully, since checks are performed in the caller
+    struct _tpool_job_s *ret = NULL;
+    struct _tpool_subq_s *sub;
+    long now = 0;
+    int shed;
+
+    //mutex lock the queue
+    _tpool_queue_lock (queue, TPOOL_LOCK_CONSUMER);
+
+    //give the blocked classes their tokens back if it's time
+    if(queue->blocked) {
+        now = _tpool_now_ns ();
+        if(now >= atomic_load_explicit (&(queue->refill_ns), memory_order_relaxed)) {
+            _tpool_class_release (queue, now, TPOOL_FALSE);
+        }
+    }
+
+    //no job is shed once the tpool shuts down
+    shed = (queue->shed_target > 0 && queue->unlimited == TPOOL_FALSE);
+    while((ret = _tpool_pick (queue, &now)) != NULL && shed) {
+        if(now == 0) {
+            now = _tpool_now_ns ();
+        }
+        if(_tpool_codel (queue, ret, now, (dropped != NULL)) == TPOOL_FALSE) {
+            break;
+        }
+        //the tenant gets back what it was charged for the job
+        sub = &(queue->sub[TPOOL_TENANT_OF(ret->opt)]);
+        atomic_fetch_sub_explicit (&(sub->vtime), (ret->charge << TPOOL_VTIME_SHIFT) /
+                                   atomic_load_explicit (&(sub->weight), memory_order_relaxed),
+                                   memory_order_relaxed);
+        ret->next = *dropped;
+        *dropped = ret;
+    }
+    //an empty queue has no standing delay
+    if(ret == NULL && shed) {
+        queue->first_above = 0;
+        atomic_store_explicit (&(queue->overloaded), TPOOL_FALSE, memory_order_relaxed);
+    }
+
+    //unlock queue when done
+    _tpool_queue_unlock (queue, TPOOL_LOCK_CONSUMER);
+    if(ret) {
+        TPOOL_PROBE4(dequeue, (char*)queue - offsetof(struct _tpool_s, queue), ret, ret->fn_ptr,
+                     atomic_load_explicit (&(queue->len), memory_order_relaxed));
+    }
+    return ret;
+}
+/* <==========================================> */
+/**
+ * @brief       Takes the next job off the queue, with the lock held. The job is taken from the
+ *                  active tenant, or from the ready class whose first job belongs to the tenant,
+ *                  with the lowest virtual time. The tenant is then charged for the estimated cost
+ *                  of the job, and _tpool_run_job corrects the charge once the actual cost is
+ *                  known. A job taken from a rate limited class takes a token
+ * 
+ * @param queue the queue
+ * @param now   the current _tpool_now_ns time, 0 if not read yet. Updated if it is read
+ * @return      struct _tpool_job_s* pointer to the job, returns NULL if no job is ready
+ */
+static struct _tpool_job_s* _tpool_pick (struct _tpool_q_s *queue, long *now)
+{
+    struct _tpool_job_s *ret = NULL;
+    struct _tpool_subq_s *sub;
+    struct _tpool_class_s *cls;
+    unsigned int mask;
+    int tenant = -1, class_id = 0, t;
+    long vtime, min = 0;
+
+    //pick the tenant, there's no choice unless several are active
+    mask = queue->active;
+    while(mask) {
+        t = __builtin_ctz (mask);
+        mask &= mask - 1;
+        vtime = atomic_load_explicit (&(queue->sub[t].vtime), memory_order_relaxed);
+        if(tenant < 0 || vtime < min) {
+            min = vtime;
+            tenant = t;
+        }
+    }
+    //a ready class competes with the tenant of its first job
+    mask = queue->ready;
+    while(mask) {
+        t = __builtin_ctz (mask);
+        mask &= mask - 1;
+        int owner = TPOOL_TENANT_OF(queue->cls[t].front->opt);
+        vtime = atomic_load_explicit (&(queue->sub[owner].vtime), memory_order_relaxed);
+        if(tenant < 0 || vtime < min) {
+            min = vtime;
+            tenant = owner;
+            class_id = t;
+        }
+    }
+
+    if(tenant >= 0) {
+        sub = &(queue->sub[tenant]);
+        if(class_id == 0) {
+            ret = _tpool_list_pop (&(sub->front), &(sub->back));
+            if(sub->front == NULL) {
+                queue->active &= ~(1U << tenant);
+            }
+        }
+        else {
+            cls = &(queue->cls[class_id]);
+            ret = _tpool_list_pop (&(cls->front), &(cls->back));
+            cls->count--;
+            if(cls->count == 0) {
+                queue->ready &= ~(1U << class_id);
+            }
+            //take a token, and block the class if that was the last one
+            if(cls->rate && queue->unlimited == TPOOL_FALSE) {
+                if(*now == 0) {
+                    *now = _tpool_now_ns ();
+                }
+                _tpool_class_refill (cls, *now);
+                cls->tokens -= TPOOL_TOKEN;
+                if(cls->count > 0 && cls->tokens < TPOOL_TOKEN) {
+                    _tpool_class_block (queue, class_id, *now);
+                }
+            }
+        }
+
+        //charge the tenant for the job, the virtual clock follows the tenants that are served
+        ret->charge = 0;
+        if(atomic_load_explicit (&(queue->fair), memory_order_relaxed) == TPOOL_TRUE) {
+            if(min > queue->vclock) {
+                queue->vclock = min;
+            }
+            ret->charge = atomic_load_explicit (&(sub->cost_ns), memory_order_relaxed);
+            atomic_fetch_add_explicit (&(sub->vtime), (ret->charge << TPOOL_VTIME_SHIFT) /
+                                       atomic_load_explicit (&(sub->weight), memory_order_relaxed),
+                                       memory_order_relaxed);
+        }
+        _tpool_queue_len_add (queue, -1);
+    }
+    return ret;
+}
+/* <==========================================> */
+/**
+ * @brief           The CoDel admission control, called with the lock held for each job that is
+ *                      taken off the queue. The tpool becomes overloaded once the queue delay has
+ *                      stayed above the target for an interval, i.e. once even the minimum delay
+ *                      over the interval is above it, and stays overloaded until a job is below
+ *                      the target again. In TPOOL_SHED_DROP mode, every sheddable job that is
+ *                      above the target is then dropped. Unlike packets, jobs come from sources
+ *                      that don't back off when some are dropped, so the gradual drop rate of the
+ *                      CoDel control law would let the queue keep growing
+ * 
+ * @param queue     the queue
+ * @param job       the job that was taken off the queue
+ * @param now       the current _tpool_now_ns time
+ * @param can_drop  TPOOL_TRUE if the caller can clean up a dropped job
+ * @return int      TPOOL_TRUE if the job must be dropped, else TPOOL_FALSE
+ */
+static int _tpool_codel (struct _tpool_q_s *queue, struct _tpool_job_s *job, long now, int can_drop)
+{
+    int overloaded = TPOOL_FALSE;
+
+    if(now - job->enq_ns < queue->shed_target) {
+        queue->first_above = 0;
+    }
+    else if(queue->first_above == 0) {
+        queue->first_above = now + queue->shed_interval;
+    }
+    else if(now >= queue->first_above) {
+        overloaded = TPOOL_TRUE;
+    }
+    atomic_store_explicit (&(queue->overloaded), overloaded, memory_order_relaxed);
+
+    //in TPOOL_SHED_REJECT mode, the producers do the shedding
+    return (overloaded && queue->shed_mode == TPOOL_SHED_DROP && can_drop &&
+            (job->opt & TPOOL_SHEDDABLE));
+}
+/* <==========================================> */
+/**
+ * @brief       The number of queued jobs that can be started, i.e. that are not held back by a
+ *                  class that is out of tokens. Can be called without the lock
+ * 
+ * @param queue the queue
+ * @return long the number of ready jobs
+ */
+static long _tpool_ready_jobs (struct _tpool_q_s *queue)
+{
+    return atomic_load_explicit (&(queue->len), memory_order_relaxed) -
+           atomic_load_explicit (&(queue->held), memory_order_relaxed);
+}
+/* <==========================================> */
+/**
+ * @brief       Adds a job to the back of a list of jobs
+ * 
+ * @param front the front of the list
+ * @param back  the back of the list
+ * @param job   the job, with its links set to NULL
+ */
+static void _tpool_list_push (struct _tpool_job_s **front, struct _tpool_job_s **back, struct _tpool_job_s *job)
+{
+    if(*front == NULL) {
+        //it is a bug if front is pointing to NULL and back is pointing to something
+        assert (*back == NULL);
+
+        *front = job;
+        *back  = job;
+    }
+    else {
+        //it is a bug if front is pointing to something and back is pointing to NULL
+        assert (*back != NULL);
+
+        //add job to the back of the list, update the links
+        (*back)->next   = job;
+        job->prev       = *back;
+        *back           = job;
+    }
+}
+/* <==========================================> */
+/**
+ * @brief       Removes the job at the front of a list of jobs
+ * 
+ * @param front the front of the list
+ * @param back  the back of the list
+ * @return struct _tpool_job_s* the job, NULL if the list is empty
+ */
+static struct _tpool_job_s* _tpool_list_pop (struct _tpool_job_s **front, struct _tpool_job_s **back)
+{
+    struct _tpool_job_s *ret = *front;
+    if(ret) {
+        //if front is pointing to something, the back should not point to NULL
+        assert (*back != NULL);
+
+        //if there is only 1 job in the list, set the list pointers to NULL
+        if(*front == *back) {
+            *front  = NULL;
+            *back   = NULL;
+        }
+        //else move the front pointer one step back
+        else {
+            *front          = ret->next;
+            (*front)->prev  = NULL;
+        }
+
+        //clean up return variable so that links aren't exposed to the caller
+        ret->prev   = NULL;
+        ret->next   = NULL;
+    }
     return ret;
 }
+/* <==========================================> */
+/**
+ * @brief       Refills the token bucket of a rate limited class for the time since its last refill
+ * 
+ * @param cls   the class
+ * @param now   the current _tpool_now_ns time
+ */
+static void _tpool_class_refill (struct _tpool_class_s *cls, long now)
+{
+    long need = cls->burst - cls->tokens;
+    long elapsed = now - cls->last_ns;
+    cls->last_ns = now;
+    if(need <= 0 || elapsed <= 0) {
+        return;
+    }
+    //elapsed * rate could overflow after a long idle time, so check against what's missing first
+    if(elapsed >= (need + cls->rate - 1) / cls->rate) {
+        cls->tokens = cls->burst;
+    }
+    else {
+        cls->tokens += elapsed * cls->rate;
+    }
+}
+/* <==========================================> */
+/**
+ * @brief           Blocks a class that has queued jobs but no tokens. Its jobs are counted in held
+ *                      and refill_ns is brought forward to its next token, if that is earlier
+ * 
+ * @param queue     the queue, with lock held
+ * @param class_id  the class
+ * @param now       the current _tpool_now_ns time, as of the last refill of the class
+ */
+static void _tpool_class_block (struct _tpool_q_s *queue, int class_id, long now)
+{
+    struct _tpool_class_s *cls = &(queue->cls[class_id]);
+    long refill = now + (TPOOL_TOKEN - cls->tokens + cls->rate - 1) / cls->rate;
+    if(queue->blocked == 0 || refill < atomic_load_explicit (&(queue->refill_ns), memory_order_relaxed)) {
+        atomic_store_explicit (&(queue->refill_ns), refill, memory_order_relaxed);
+    }
+    queue->blocked |= (1U << class_id);
+    queue->ready &= ~(1U << class_id);
+    atomic_store_explicit (&(queue->held), atomic_load_explicit (&(queue->held), memory_order_relaxed) + cls->count, memory_order_relaxed);
+}
+/* <==========================================> */
+/**
+ * @brief           Unblocks a blocked class, its jobs are ready again
+ * 
+ * @param queue     the queue, with lock held
+ * @param class_id  the class
+ */
+static void _tpool_class_unblock (struct _tpool_q_s *queue, int class_id)
+{
+    queue->blocked &= ~(1U << class_id);
+    queue->ready |= (1U << class_id);
+    atomic_store_explicit (&(queue->held), atomic_load_explicit (&(queue->held), memory_order_relaxed) - queue->cls[class_id].count, memory_order_relaxed);
+    atomic_store_explicit (&(queue->unblocked), TPOOL_TRUE, memory_order_relaxed);
+}
+/* <==========================================> */
+/**
+ * @brief           Unblocks the blocked classes that have a token again (or all of them), and
+ *                      moves refill_ns to the next token of the ones that are still blocked
+ * 
+ * @param queue     the queue, with lock held
+ * @param now       the current _tpool_now_ns time, unused if all is set
+ * @param all       TPOOL_TRUE to unblock every class, whatever its tokens
+ */
+static void _tpool_class_release (struct _tpool_q_s *queue, long now, int all)
+{
+    struct _tpool_class_s *cls;
+    unsigned int mask = queue->blocked;
+    long refill, next = 0;
+    int t;
+    while(mask) {
+        t = __builtin_ctz (mask);
+        mask &= mask - 1;
+        cls = &(queue->cls[t]);
+        if(all == TPOOL_FALSE) {
+            _tpool_class_refill (cls, now);
+        }
+        if(all == TPOOL_TRUE || cls->tokens >= TPOOL_TOKEN) {
+            _tpool_class_unblock (queue, t);
+        }
+        else {
+            refill = now + (TPOOL_TOKEN - cls->tokens + cls->rate - 1) / cls->rate;
+            if(next == 0 || refill < next) {
+                next = refill;
+            }
+        }
+    }
+    atomic_store_explicit (&(queue->refill_ns), next, memory_order_relaxed);
+}
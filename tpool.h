@@ -22,6 +22,10 @@ SOFTWARE. */
 
 #ifndef __TPOOL_H__
 #define __TPOOL_H__
+#include <stddef.h>
+#include <stdio.h>
+#include <sched.h>
+#include <pthread.h>
 /************************************************************************************/
 /**
  * @brief options that can be provided to tpool_add_job and tpool_destroy
@@ -35,6 +39,363 @@ SOFTWARE. */
  * has been performed normally. Perhaps, a more elegant solution can be thought of for this. 
  */
 #define TPOOL_RUN_DESTRUCTOR_AFTER_JOB      (1<<1)
+/**
+ * The job may be shed by the admission control of the tpool (see tpool_attr_t.shed_target_ns) when
+ * it is overloaded: tpool_add_job fails with errno EBUSY, or the job is dropped from the queue and
+ * its destructor (if any) is run
+ */
+#define TPOOL_SHEDDABLE                     (1<<2)
+/**
+ * The tenant that a job is added for, OR'd into the options. Each tenant has a queue of its own,
+ * and the workers share their time between the tenants that have queued jobs as per the tenant
+ * weights (see tpool_set_tenant_weight). Jobs are added for tenant 0 by default
+ */
+#define TPOOL_MAX_TENANTS                   16
+#define TPOOL_OPT_TENANT(id)                (((id) & (TPOOL_MAX_TENANTS - 1)) << 16)
+//the weight of a tenant, before tpool_set_tenant_weight is called for it
+#define TPOOL_TENANT_WEIGHT_DEFAULT         1
+#define TPOOL_TENANT_WEIGHT_MAX             1000
+/**
+ * The class that a job is added for, OR'd into the options. The jobs of a class can be rate limited
+ * with tpool_set_class_rate. Class 0 (the default) is never limited. The jobs of the other
+ * classes are started in the order they were added, whatever their tenant
+ */
+#define TPOOL_MAX_CLASSES                   16
+#define TPOOL_OPT_CLASS(id)                 (((id) & (TPOOL_MAX_CLASSES - 1)) << 20)
+/************************************************************************************/
+/**
+ * @brief options that can be provided to tpool_wait and tpool_group_wait
+ * 
+ */
+#define TPOOL_WAIT_NO_OPT                   0
+/**
+ * Lets a thread that is not running a job of the tpool run queued jobs while it waits. Jobs that
+ * wait always do this, since a worker that just blocks can deadlock the pool with nested waits
+ */
+#define TPOOL_WAIT_HELP                     (1<<0)
+/************************************************************************************/
+/**
+ * @brief what tpool_shutdown does with the jobs that are still queued
+ * 
+ */
+//the TPOOL_CLEANUP_RUN_JOB and TPOOL_RUN_DESTRUCTOR_AFTER_JOB options of each job decide, as in tpool_destroy
+#define TPOOL_SHUTDOWN_JOB_OPT              0
+//every queued job is performed
+#define TPOOL_SHUTDOWN_DRAIN                1
+//no queued job is performed, only the destructors are run
+#define TPOOL_SHUTDOWN_DISCARD              2
+//the queued jobs are performed until the deadline passes, the rest are discarded
+#define TPOOL_SHUTDOWN_DEADLINE             3
+/************************************************************************************/
+/**
+ * @brief options that can be provided to tpool_pause
+ * 
+ */
+#define TPOOL_PAUSE_NO_OPT                  0
+//wait until the jobs that are already running have completed
+#define TPOOL_PAUSE_WAIT                    (1<<0)
+/************************************************************************************/
+/**
+ * @brief where the stacks of the worker threads come from (tpool_attr_t.stack_mode)
+ * 
+ */
+//every worker stack is allocated by pthread_create
+#define TPOOL_STACK_DEFAULT                 0
+//the worker stacks are carved out of one region that the tpool maps up front
+#define TPOOL_STACK_PREALLOC                1
+//same as TPOOL_STACK_PREALLOC, but the region is backed by huge pages. Falls back to transparent
+//huge pages if no huge pages are reserved
+#define TPOOL_STACK_HUGEPAGE                2
+/************************************************************************************/
+/**
+ * @brief flags for tpool_attr_t.flags
+ * 
+ */
+#define TPOOL_ATTR_NO_FLAGS                 0
+/**
+ * Busy poll mode for pools that own dedicated cores and only care about latency. The workers never
+ * sleep, they poll the queue with a pause/umwait backoff, and tpool_add_job skips the semaphore
+ * post (a syscall when a worker is asleep) altogether
+ */
+#define TPOOL_ATTR_BUSY_POLL                (1<<0)
+/**
+ * Instrumented queue lock, for profiling how contended it is. The producers (tpool_add_job) and the
+ * consumers (the dequeues) count their acquisitions of the lock, how many of them found it taken
+ * (a trylock is tried first), and the time spent waiting for it and holding it. See
+ * tpool_stats_t.lock_producers
+ */
+#define TPOOL_ATTR_LOCK_STATS               (1<<1)
+/************************************************************************************/
+/**
+ * @brief tpool_attr_t.sched_policy value for workers that inherit the scheduling policy and
+ *          priority of the thread that creates them. Any other value is a policy from sched.h,
+ *          e.g. SCHED_FIFO, SCHED_RR or SCHED_OTHER
+ * 
+ */
+#define TPOOL_SCHED_INHERIT                 (-1)
+/************************************************************************************/
+/**
+ * @brief what the admission control does with the sheddable jobs when the tpool is overloaded
+ *          (tpool_attr_t.shed_mode)
+ * 
+ */
+//tpool_add_job fails for them
+#define TPOOL_SHED_REJECT                   0
+//the ones that have waited for longer than the target are dropped from the front of the queue
+#define TPOOL_SHED_DROP                     1
+/************************************************************************************/
+//the tpool_t of tpool_attr_t.watchdog_fn, see below
+struct _tpool_s;
+/**
+ * @brief               A job that has been running for longer than the watchdog threshold, see
+ *                          tpool_attr_t.watchdog_ns
+ * @var worker          The index of the worker that runs it
+ * @var thread          The worker thread, e.g. to pthread_kill it with a signal whose handler
+ *                          captures its stack trace with backtrace()
+ * @var tid             The kernel thread id of the worker, e.g. for gdb, perf or /proc/<pid>/task/<tid>
+ * @var fn              The job function
+ * @var arg             The job argument
+ * @var running_ns      How long the job has been running for
+ * 
+ */
+typedef struct {
+    int                 worker;
+    pthread_t           thread;
+    int                 tid;
+    void                (*fn) (void*);
+    void                *arg;
+    long                running_ns;
+} tpool_stuck_job_t;
+//the size of the name of a tpool, including the terminating null (tpool_attr_t.name)
+#define TPOOL_NAME_MAX                      64
+/************************************************************************************/
+/**
+ * @brief           The creation attributes for tpool_create_ex. Must be initialised with
+ *                      tpool_attr_init before the fields are set
+ * @var stack_size  The stack size of each worker thread in bytes, 0 => system default
+ * @var guard_size  The size of the guard area below each worker stack in bytes, 0 => no guard
+ * @var stack_mode  One of the TPOOL_STACK_* values
+ * @var spin_max_ns The upper limit for how long an idle worker spins before it sleeps, 0 => never
+ *                      spin. Each worker adapts its own budget below this to its job arrivals
+ * @var flags       Bitwise TPOOL_ATTR_* flags
+ * @var sched_policy   The scheduling policy of the workers, TPOOL_SCHED_INHERIT or a SCHED_* policy.
+ *                      If the process lacks the privileges for it, the workers fall back to
+ *                      TPOOL_SCHED_INHERIT
+ * @var sched_priority The static priority for SCHED_FIFO and SCHED_RR, must be 0 for the others
+ * @var nice        The nice value of the workers for the non real time policies, 0 => unchanged.
+ *                      Ignored if the process lacks the privileges for it
+ * @var shed_target_ns The target queue delay of the admission control (CoDel), 0 => disabled. The
+ *                      tpool is overloaded once the delay of the dequeued jobs has stayed above
+ *                      this for shed_interval_ns, and the sheddable jobs are shed until it drops
+ *                      below it again. The jobs are timestamped when they are added for this
+ * @var shed_interval_ns The interval over which the minimum queue delay is tracked
+ * @var shed_mode   One of the TPOOL_SHED_* values
+ * @var trace_events The number of events kept per worker by the tracer (rounded up to a power of
+ *                      2), 0 => no tracer. See tpool_trace_dump
+ * @var watchdog_ns The watchdog threshold, 0 => no watchdog. A monitor thread checks the job that
+ *                      each worker is running, and reports the ones that have been running for
+ *                      longer than this (once per job). The start times are taken from the coarse
+ *                      monotonic clock, so the threshold should be well above its resolution
+ *                      (a few ms)
+ * @var watchdog_fn Called by the monitor thread with each stuck job, NULL => a line is written to
+ *                      stderr instead. Must not block for long, since it delays the other reports
+ * @var watchdog_arg The last argument of watchdog_fn
+ * @var shm_name    The name of a POSIX shared memory segment (e.g. "/myservice.tpool") that the
+ *                      stats are published to, NULL => none. See tpool_shm_attach. The segment is
+ *                      created (or replaced) with mode 0644 and unlinked by tpool_join
+ * @var shm_interval_ns How often the stats are published, at least. The watchdog checks also
+ *                      publish them
+ * @var name        The name of the tpool, the pool label of its metrics (truncated to
+ *                      TPOOL_NAME_MAX - 1 characters), NULL => "tpool"
+ * 
+ */
+typedef struct {
+    size_t      stack_size;
+    size_t      guard_size;
+    int         stack_mode;
+    long        spin_max_ns;
+    int         flags;
+    int         sched_policy;
+    int         sched_priority;
+    int         nice;
+    long        shed_target_ns;
+    long        shed_interval_ns;
+    int         shed_mode;
+    long        trace_events;
+    long        watchdog_ns;
+    void        (*watchdog_fn) (struct _tpool_s *tpool, const tpool_stuck_job_t *job, void *arg);
+    void        *watchdog_arg;
+    const char  *shm_name;
+    long        shm_interval_ns;
+    const char  *name;
+} tpool_attr_t;
+/**
+ * @brief the states of a worker thread (tpool_worker_stats_t.state)
+ * 
+ */
+#define TPOOL_WORKER_RUNNING                0
+#define TPOOL_WORKER_SPINNING               1
+#define TPOOL_WORKER_PARKED                 2
+/**
+ * @brief               The statistics of a worker thread, see tpool_get_worker_stats
+ * @var state           The current state of the worker, one of the TPOOL_WORKER_* values
+ * @var spin_budget_ns  How long the worker currently spins for a job before it sleeps
+ * @var spin_hits       The number of times that a job arrived while the worker was spinning
+ * @var spin_misses     The number of times that the worker spun and then had to sleep
+ * @var jobs            The number of jobs that the worker has run
+ * @var busy_ns         The time that the worker has spent outside of its idle waits
+ * @var idle_ns         The time that the worker has spent spinning, parked or polling
+ * @var wakeups         The number of times that the worker was woken up after it parked
+ * @var empty_wakeups   The number of wakeups after which the worker found no job
+ * 
+ */
+typedef struct {
+    int                 state;
+    long                spin_budget_ns;
+    unsigned long       spin_hits;
+    unsigned long       spin_misses;
+    unsigned long       jobs;
+    unsigned long       busy_ns;
+    unsigned long       idle_ns;
+    unsigned long       wakeups;
+    unsigned long       empty_wakeups;
+} tpool_worker_stats_t;
+/**
+ * @brief               The queue lock statistics of one side, see TPOOL_ATTR_LOCK_STATS
+ * @var acquired        The number of times that the lock was taken
+ * @var contended       The number of times that it was taken by another thread at first
+ * @var wait_ns         The total time spent waiting for it
+ * @var hold_ns         The total time that it was held for
+ * 
+ */
+typedef struct {
+    unsigned long       acquired;
+    unsigned long       contended;
+    unsigned long       wait_ns;
+    unsigned long       hold_ns;
+} tpool_lock_stats_t;
+/**
+ * @brief               The statistics of a tpool, see tpool_get_stats
+ * @var submitted       The number of jobs that have been added
+ * @var completed       The number of jobs that have completed, been discarded or been shed
+ * @var queued          The number of jobs in the queue
+ * @var rejected        The number of sheddable jobs that tpool_add_job turned away
+ * @var dropped         The number of sheddable jobs that were dropped from the queue
+ * @var jobs            The number of jobs run by the workers (including the extra ones), the
+ *                          rest of the completed jobs were run by waiting threads or discarded
+ * @var busy_ns         The total busy time of the workers, see tpool_worker_stats_t
+ * @var idle_ns         The total idle time of the workers
+ * @var wakeups         The total wakeups of the workers
+ * @var empty_wakeups   The total empty wakeups of the workers
+ * @var lock_producers  The queue lock statistics of the producers, all 0 without TPOOL_ATTR_LOCK_STATS
+ * @var lock_consumers  The queue lock statistics of the consumers
+ * 
+ */
+typedef struct {
+    unsigned long       submitted;
+    unsigned long       completed;
+    long                queued;
+    unsigned long       rejected;
+    unsigned long       dropped;
+    unsigned long       jobs;
+    unsigned long       busy_ns;
+    unsigned long       idle_ns;
+    unsigned long       wakeups;
+    unsigned long       empty_wakeups;
+    tpool_lock_stats_t  lock_producers;
+    tpool_lock_stats_t  lock_consumers;
+} tpool_stats_t;
+/**
+ * @brief               The queue depth of a tpool over time, see tpool_get_queue_stats
+ * @var depth           The number of jobs in the queue now
+ * @var max_depth       The high-water mark of the queue since the last reset
+ * @var avg_depth       The time-weighted average number of jobs in the queue since the last reset
+ * @var window_ns       The time since the last reset (or since the tpool was created)
+ * 
+ */
+typedef struct {
+    long                depth;
+    long                max_depth;
+    double              avg_depth;
+    long                window_ns;
+} tpool_queue_stats_t;
+/**
+ * @brief               The profile of a job function, see tpool_get_profile
+ * @var fn              The job function, NULL for the functions that didn't fit in the profiler
+ * @var calls           The number of jobs of the function that were run
+ * @var wall_ns         The total wall time of those jobs
+ * @var max_ns          The longest wall time of one of them
+ * @var cpu_ns          The total CPU time of those jobs (CLOCK_THREAD_CPUTIME_ID)
+ * 
+ */
+typedef struct {
+    void                (*fn) (void*);
+    unsigned long       calls;
+    unsigned long       wall_ns;
+    unsigned long       max_ns;
+    unsigned long       cpu_ns;
+} tpool_prof_entry_t;
+/************************************************************************************/
+/**
+ * @brief the latency histograms are log-linear (as in HdrHistogram): each power of 2 range of ns
+ *          is split into 2^TPOOL_HIST_SUB_BITS linear buckets, so the values in a bucket are within
+ *          1/16 of each other. The values below 2^TPOOL_HIST_SUB_BITS ns get a bucket each, the
+ *          ones from 2^TPOOL_HIST_MAX_BITS ns (~18 minutes) on share the last bucket
+ * 
+ */
+#define TPOOL_HIST_SUB_BITS                 4
+#define TPOOL_HIST_MAX_BITS                 40
+#define TPOOL_HIST_BUCKETS                  ((TPOOL_HIST_MAX_BITS - TPOOL_HIST_SUB_BITS + 1) << TPOOL_HIST_SUB_BITS)
+//the tpool_get_latency index that merges the histograms of all the workers, and of the other
+//threads that ran jobs (waiting threads, extra workers)
+#define TPOOL_LATENCY_ALL                   (-1)
+/**
+ * @brief               A latency histogram, see TPOOL_HIST_SUB_BITS
+ * @var count           The number of values recorded
+ * @var sum_ns          The sum of the values
+ * @var max_ns          The largest value
+ * @var buckets         The number of values in each bucket, see tpool_hist_bucket_ns
+ * 
+ */
+typedef struct {
+    unsigned long       count;
+    unsigned long       sum_ns;
+    unsigned long       max_ns;
+    unsigned long       buckets[TPOOL_HIST_BUCKETS];
+} tpool_hist_t;
+/**
+ * @brief               The latency histograms of a tpool, see tpool_get_latency
+ * @var wait            The time that the jobs spent in the queue, from tpool_add_job to dequeue
+ * @var exec            The time that the jobs spent in their job function
+ * 
+ */
+typedef struct {
+    tpool_hist_t        wait;
+    tpool_hist_t        exec;
+} tpool_latency_t;
+/**
+ * @brief               A snapshot of the stats that a tpool publishes to its shared memory segment,
+ *                          see tpool_attr_t.shm_name and tpool_shm_read
+ * @var pid             The process of the tpool
+ * @var workers         The number of workers of the tpool
+ * @var closed          TPOOL_TRUE once the tpool has been destroyed, this is its last snapshot
+ * @var time_ns         The CLOCK_MONOTONIC time of the snapshot, for computing rates between two
+ * @var interval_ns     The publishing interval of the tpool
+ * @var stats           See tpool_get_stats
+ * @var queue           See tpool_get_queue_stats
+ * @var latency         See tpool_get_latency (TPOOL_LATENCY_ALL), empty unless the timing is on
+ * 
+ */
+typedef struct {
+    long                pid;
+    int                 workers;
+    int                 closed;
+    long                time_ns;
+    long                interval_ns;
+    tpool_stats_t       stats;
+    tpool_queue_stats_t queue;
+    tpool_latency_t     latency;
+} tpool_shm_stats_t;
 /************************************************************************************/
 /**
  * @brief The opaque structure that will be the handle to a thread pool. The caller does not need to
@@ -42,6 +403,18 @@ SOFTWARE. */
  * 
  */
 typedef struct _tpool_s tpool_t;
+/**
+ * @brief The opaque handle to the shared memory stats segment of a tpool, attached from another
+ *              process (or the same one)
+ * 
+ */
+typedef struct _tpool_shm_s tpool_shm_t;
+/**
+ * @brief The opaque structure that will be the handle to a job group. Jobs added through a group
+ *              can be waited for together, e.g. a job can wait for the subjobs that it submitted
+ * 
+ */
+typedef struct _tpool_group_s tpool_group_t;
 /************************************************************************************/
 //function declarations
 /**
@@ -52,11 +425,29 @@ typedef struct _tpool_s tpool_t;
  */
 tpool_t* tpool_create (int count);
 
+/**
+ * @brief           Initialises the given attributes with the defaults used by tpool_create
+ * 
+ * @param attr      The attributes to be initialised
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_attr_init (tpool_attr_t *attr);
+
+/**
+ * @brief           Same as tpool_create, but with the given creation attributes
+ * 
+ * @param count     Specifies the number of worker threads required for this tpool
+ * @param attr      The creation attributes, NULL => defaults
+ * @return tpool_t* Pointer to the tpool - this will be the unique handle for this tpool
+ */
+tpool_t* tpool_create_ex (int count, const tpool_attr_t *attr);
+
 /**
  * @brief               Adds the given job to the thread pool. Will fail if 
  *                          tpool is not properly initialised
  *                          job_fn is NULL
- *                          memory allocation fails * 
+ *                          memory allocation fails
+ *                          the job is TPOOL_SHEDDABLE and the tpool sheds jobs (errno EBUSY) * 
  * @param tpool         The handle to the tpool
  * @param job_fn        The function pointer for the job to be performed
  * @param arg           The (optional) arg for job_fn
@@ -67,11 +458,360 @@ tpool_t* tpool_create (int count);
 int tpool_add_job (tpool_t *tpool, void (*job_fn)(void *), void *arg, void (*destructor)(void*), int opt);
 
 /**
- * @brief           Destroys the given thread pool and its associated sync variables. Can fail if
+ * @brief           Sets the weight of a tenant. When several tenants have queued jobs, each one
+ *                      gets a share of the worker time proportional to its weight, no matter how
+ *                      many jobs it adds. Can fail if
+ *                      ->tpool is NULL
+ *                      ->tenant is not in 0 to TPOOL_MAX_TENANTS-1
+ *                      ->weight is not in 1 to TPOOL_TENANT_WEIGHT_MAX
+ * 
+ * @param tpool     The thread pool
+ * @param tenant    The tenant, as given to TPOOL_OPT_TENANT
+ * @param weight    The weight of the tenant
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_set_tenant_weight (tpool_t *tpool, int tenant, int weight);
+
+/**
+ * @brief           Limits how many jobs of a class are started per second, with a token bucket of
+ *                      burst tokens that refills at rate tokens per second. Every job takes a
+ *                      token when it is started. While a class is out of tokens, its jobs stay
+ *                      queued without holding up a worker, the jobs of other classes keep flowing,
+ *                      and a worker is woken up at the next refill. The bucket starts full. The
+ *                      limits are lifted when the tpool shuts down. Can fail if
+ *                      ->tpool is NULL
+ *                      ->class is not in 1 to TPOOL_MAX_CLASSES-1
+ *                      ->rate is not in 0 to 1000000000, or burst is less than 1
+ * 
+ * @param tpool     The thread pool
+ * @param class_id  The class, as given to TPOOL_OPT_CLASS
+ * @param rate      The number of jobs per second, 0 => unlimited
+ * @param burst     The size of the bucket, i.e. how many jobs can be started at once
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_set_class_rate (tpool_t *tpool, int class_id, long rate, long burst);
+
+/**
+ * @brief           Waits until the thread pool is idle, i.e. every job that has been added has
+ *                      completed. With TPOOL_WAIT_HELP, the calling thread runs queued jobs while
+ *                      it waits. Will fail if
+ *                          tpool is not properly initialised
+ *                          it is called from a job of the same tpool, since it would wait for itself
+ * 
+ * @param tpool     The handle to the tpool
+ * @param opt       The options for the wait (TPOOL_WAIT_NO_OPT or TPOOL_WAIT_HELP)
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_wait (tpool_t *tpool, int opt);
+
+/**
+ * @brief           Creates a job group on the given thread pool
+ * 
+ * @param tpool     The handle to the tpool
+ * @return tpool_group_t* Pointer to the group, NULL on failure
+ */
+tpool_group_t* tpool_group_create (tpool_t *tpool);
+
+/**
+ * @brief               Adds the given job to the thread pool of the group, as a member of the group.
+ *                          Fails under the same conditions as tpool_add_job
+ * 
+ * @param group         The handle to the group
+ * @param job_fn        The function pointer for the job to be performed
+ * @param arg           The (optional) arg for job_fn
+ * @param destructor    The (optional) destructor for arg
+ * @param opt           The options for job to be performed
+ * @return int          Returns 0 on success, -1 on failure
+ */
+int tpool_group_add_job (tpool_group_t *group, void (*job_fn)(void *), void *arg, void (*destructor)(void*), int opt);
+
+/**
+ * @brief           Waits until every job of the group has completed. A job of the same tpool that
+ *                      calls this runs queued jobs while it waits, so that nested waits cannot use
+ *                      up all the workers. Other threads do so only with TPOOL_WAIT_HELP. Will fail if
+ *                          group is NULL or its tpool is not properly initialised
+ * 
+ * @param group     The handle to the group
+ * @param opt       The options for the wait (TPOOL_WAIT_NO_OPT or TPOOL_WAIT_HELP)
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_group_wait (tpool_group_t *group, int opt);
+
+/**
+ * @brief           Destroys the given group. Fails if the group still has jobs that have not completed
+ * 
+ * @param group     The group to be destroyed. takes tpool_group_t** because the tpool_group_t* will also be freed
+ * @return int      Returns 0 on Success, -1 on failure
+ */
+int tpool_group_destroy (tpool_group_t **group);
+
+/**
+ * @brief           Stops the tpool from starting jobs. Jobs can still be added, they stay queued
+ *                      until tpool_resume. The idle workers park, they don't spin or poll. Waits
+ *                      don't help out either, so a wait for queued jobs blocks until tpool_resume.
+ *                      Can fail if
+ *                      ->tpool is NULL
+ *                      ->TPOOL_PAUSE_WAIT is given by a job of the same tpool
+ * 
+ * @param tpool     The thread pool
+ * @param opt       TPOOL_PAUSE_WAIT to return only once the running jobs have completed. Must not
+ *                      be used if running jobs wait for queued ones, else TPOOL_PAUSE_NO_OPT
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_pause (tpool_t *tpool, int opt);
+
+/**
+ * @brief           Lets a paused tpool start jobs again. Wakes up as many parked workers as there
+ *                      are queued jobs (all of them in busy poll mode). Can fail if tpool is NULL
+ * 
+ * @param tpool     The thread pool
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_resume (tpool_t *tpool);
+
+/**
+ * @brief           Marks the start of a region in which the calling job blocks, e.g. on fsync, a
+ *                      DNS lookup or flock. While the region is open, the tpool admits an extra
+ *                      worker so that the other queued jobs keep all the cores busy. The extra
+ *                      worker retires once the region ends. Will fail if it is not called from a job
+ * 
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_blocking_begin (void);
+
+/**
+ * @brief           Marks the end of a region started with tpool_blocking_begin. Will fail if it is
+ *                      not called from a job, or if there is no open blocking region
+ * 
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_blocking_end (void);
+
+/**
+ * @brief           Reads the statistics of a worker thread, without stopping it
+ * 
+ * @param tpool     The handle to the tpool
+ * @param idx       The index of the worker, from 0 to the worker count - 1
+ * @param stats     Filled with the statistics
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_get_worker_stats (tpool_t *tpool, int idx, tpool_worker_stats_t *stats);
+
+/**
+ * @brief           Reads the statistics of the tpool, summed over all of its workers. The workers
+ *                      are not stopped for this, so the counters are read one by one. Can fail if
+ *                      ->tpool or stats is NULL
+ * 
+ * @param tpool     The thread pool
+ * @param stats     Filled with the statistics
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_get_stats (tpool_t *tpool, tpool_stats_t *stats);
+
+/**
+ * @brief           Returns the number of jobs in the queue, i.e. added and not yet started. This is
+ *                      a single atomic load, so it can be polled often
+ * 
+ * @param tpool     The handle to the tpool
+ * @return long     Returns the queue depth, -1 on failure
+ */
+long tpool_queue_depth (tpool_t *tpool);
+
+/**
+ * @brief           Reads the queue depth, its high-water mark and its time-weighted average since
+ *                      the last reset, without taking the queue lock. The average integrates the
+ *                      depth as a step function over the coarse clock, which is read on every
+ *                      change of the depth, so it is exact to within a coarse clock tick (a few ms)
+ * 
+ * @param tpool     The handle to the tpool
+ * @param stats     Filled with the statistics
+ * @param reset     TPOOL_TRUE (1) to start a new window afterwards: the high-water mark is set to
+ *                      the current depth and the average starts again
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_get_queue_stats (tpool_t *tpool, tpool_queue_stats_t *stats, int reset);
+
+/**
+ * @brief           Turns the timestamping of the jobs for the latency histograms on or off. It is
+ *                      off by default, and then the jobs are not timestamped at all. Only the jobs
+ *                      added while it is on are recorded
+ * 
+ * @param tpool     The handle to the tpool
+ * @param enable    TPOOL_TRUE (1) to turn it on, 0 to turn it off
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_set_timing (tpool_t *tpool, int enable);
+
+/**
+ * @brief           Takes a snapshot of the latency histograms of a worker, without stopping it
+ * 
+ * @param tpool     The handle to the tpool
+ * @param idx       The index of the worker, or TPOOL_LATENCY_ALL to merge all of them
+ * @param lat       Filled with the histograms
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_get_latency (tpool_t *tpool, int idx, tpool_latency_t *lat);
+
+/**
+ * @brief           Adds the values of the histogram src to dst, e.g. to merge the snapshots of
+ *                      several tpools
+ * 
+ * @param dst       The histogram that is added to
+ * @param src       The histogram to add
+ */
+void tpool_hist_merge (tpool_hist_t *dst, const tpool_hist_t *src);
+
+/**
+ * @brief           Returns the given percentile of a histogram, i.e. the upper end of the bucket
+ *                      that holds it (at most max_ns)
+ * 
+ * @param hist      The histogram
+ * @param pct       The percentile, from 0 to 100, e.g. 99.9
+ * @return long     Returns the percentile in ns, -1 if the histogram is empty
+ */
+long tpool_hist_percentile (const tpool_hist_t *hist, double pct);
+
+/**
+ * @brief           Returns the lowest value of a bucket of the histograms
+ * 
+ * @param idx       The index of the bucket, from 0 to TPOOL_HIST_BUCKETS - 1
+ * @return long     Returns the value in ns, -1 if idx is out of range
+ */
+long tpool_hist_bucket_ns (int idx);
+
+/**
+ * @brief           Turns the profiling of the job functions on or off. It is off by default. While
+ *                      it is on, each worker counts the calls, wall time and CPU time of the jobs
+ *                      it runs, per job function
+ * 
+ * @param tpool     The handle to the tpool
+ * @param enable    TPOOL_TRUE (1) to turn it on, 0 to turn it off
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_set_profiling (tpool_t *tpool, int enable);
+
+/**
+ * @brief           Reads the profile of the job functions, merged over the workers, sorted by CPU
+ *                      time (highest first)
+ * 
+ * @param tpool     The handle to the tpool
+ * @param entries   Filled with the profile of up to max job functions
+ * @param max       The size of entries
+ * @return int      Returns the number of entries filled, -1 on failure
+ */
+int tpool_get_profile (tpool_t *tpool, tpool_prof_entry_t *entries, int max);
+
+/**
+ * @brief           Writes the profile of the job functions as a table, sorted by CPU time. The
+ *                      functions are named with dladdr, so the functions that are not exported
+ *                      are only named if the program is linked with -rdynamic
+ * 
+ * @param tpool     The handle to the tpool
+ * @param fp        The file to write to, e.g. stdout
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_profile_dump (tpool_t *tpool, FILE *fp);
+
+/**
+ * @brief           Writes the events recorded by the tracer (tpool_attr_t.trace_events) to a file
+ *                      in the Chrome Trace Event JSON format, which opens in Perfetto or
+ *                      chrome://tracing. Each worker is a thread on the timeline, with its jobs
+ *                      and the times it was parked, and each job is linked to where it was added.
+ *                      The tracer keeps recording meanwhile, and only the latest trace_events
+ *                      events of each worker are kept. Can fail if
+ *                      ->the tpool has no tracer
+ *                      ->the file can't be written (errno set)
+ * 
+ * @param tpool     The handle to the tpool
+ * @param path      The path of the file to write
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_trace_dump (tpool_t *tpool, const char *path);
+
+/**
+ * @brief           Writes the metrics of the tpool in the Prometheus text exposition format, e.g.
+ *                      for a /metrics endpoint (open_memstream gives a FILE* that writes to a
+ *                      buffer). The metrics are labelled with the pool name, and the per worker
+ *                      ones with the worker index. They are read from one snapshot of the stats,
+ *                      so the jobs don't do any work for them. The latency histograms are only
+ *                      filled while the timing is on, see tpool_set_timing
+ * 
+ * @param tpool     The handle to the tpool
+ * @param fp        The file to write to
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_metrics_write (tpool_t *tpool, FILE *fp);
+
+/**
+ * @brief           Attaches (read only) to the stats segment that a tpool publishes to, see
+ *                      tpool_attr_t.shm_name. Can fail if
+ *                      ->the segment doesn't exist or can't be mapped (errno set)
+ *                      ->the segment is not a tpool stats segment of this version
+ * 
+ * @param name      The name of the segment
+ * @return tpool_shm_t* The handle to the segment, NULL on failure
+ */
+tpool_shm_t* tpool_shm_attach (const char *name);
+
+/**
+ * @brief           Reads a consistent snapshot from an attached stats segment. The tpool writes
+ *                      the segment under a seqlock, so this retries while a write is in progress.
+ *                      Can fail if
+ *                      ->the tpool stays in the middle of a write, e.g. it crashed (errno EAGAIN)
+ * 
+ * @param shm       The handle to the segment
+ * @param stats     Filled with the snapshot
+ * @param workers   Filled with the stats of the first max workers, may be NULL if max is 0
+ * @param max       The size of workers
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_shm_read (tpool_shm_t *shm, tpool_shm_stats_t *stats, tpool_worker_stats_t *workers, int max);
+
+/**
+ * @brief           Detaches from a stats segment and frees the handle
+ * 
+ * @param shm       The handle to the segment, set to NULL
+ * @return int      Returns 0 on success, -1 on failure
+ */
+int tpool_shm_detach (tpool_shm_t **shm);
+
+/**
+ * @brief           Starts shutting down the thread pool and returns without waiting. The workers
+ *                      handle the queued jobs as given by mode, in parallel, and then exit.
+ *                      Jobs added by the running jobs are handled the same way. Call tpool_join
+ *                      to wait for the workers and free the tpool, so that the shutdowns of
+ *                      several pools can overlap. Can fail if
+ *                      ->tpool is NULL
+ *                      ->mode is invalid
+ *                      ->the tpool is already shutting down
+ * 
+ * @param tpool     The thread pool
+ * @param mode      One of the TPOOL_SHUTDOWN_* values
+ * @param deadline_ms For TPOOL_SHUTDOWN_DEADLINE, how many ms from now the queued jobs may still
+ *                      be performed for. Ignored for the other modes
+ * @return int      Returns 0 on Success, -1 on failure
+ */
+int tpool_shutdown (tpool_t *tpool, int mode, long deadline_ms);
+
+/**
+ * @brief           Waits for the workers of a thread pool that is shutting down to exit, then
+ *                      destroys the thread pool and its associated sync variables. Can fail if
+ *                      ->tpool is NULL or *tpool is NULL
+ *                      ->tpool_shutdown was not called
+ *                      ->any cleanup fails
+ * 
+ * @param tpool     The thread pool to be destroyed. takes tpool_t** because the tpool_t* will also be freed at the end
+ * @return int      Returns 0 on Success, -1 on failure
+ */
+int tpool_join (tpool_t **tpool);
+
+/**
+ * @brief           Destroys the given thread pool and its associated sync variables, same as
+ *                      tpool_shutdown with TPOOL_SHUTDOWN_JOB_OPT followed by tpool_join. Can fail if
  *                      ->tpool is NULL or *tpool is NULL
  *                      ->any cleanup fails
- *                  The destructor for a job will be run regardless of options since the thread pool is being 
- *                      forcibly destroyed
+ *                  A queued job is performed only if it has TPOOL_CLEANUP_RUN_JOB, and its destructor is run
+ *                      only if it has TPOOL_RUN_DESTRUCTOR_AFTER_JOB
  * 
  * @param tpool     The thread pool to be destroyed. takes tpool_t** because the tpool_t* will also be freed at the end
  * @return int      Returns 0 on Success, -1 on failure